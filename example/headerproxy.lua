@@ -0,0 +1,71 @@
+-- The rules of headerproxy.php as a Lua script, to be run inside Varnish
+-- with headerproxy.lua(). See default.vcl.
+--
+-- The script is run once per worker thread when it first gets a request. It
+-- returns the function that is then called for every request, with a table
+-- of the path, method, url and forwarded headers (by lower case name), and
+-- that returns the headers to set like the web script does.
+
+-- Returns the value of a cookie, or nil
+local function cookie(req, name)
+    local header = req.headers["cookie"]
+    if header == nil then
+        return nil
+    end
+    return header:match("%f[%w]" .. name .. "=([^;]*)")
+end
+
+-- Simulates geographic location lookup. 10.x.x.x networks are "US",
+-- 192.x.x.x networks are "UK".
+local function set_geo_location(req, context)
+    local geo = cookie(req, "geo")
+
+    if geo == nil then
+        local ip = req.headers["x-forwarded-for"] or "10.1.1.1"
+
+        if ip:match("^192%.") then
+            geo = "UK"
+        else
+            geo = "US"
+        end
+
+        -- Skips the lookup on the next visits of this user
+        context.cookies[#context.cookies + 1] = "geo=" .. geo
+    end
+
+    context.headers[#context.headers + 1] = "X-Geo: " .. geo
+    context.vary[#context.vary + 1] = "X-Geo"
+end
+
+-- Simulates being in an AB test. Add the request header Put-In-AB-Test to be
+-- put in the test.
+local function set_ab_test(req, context)
+    local ab = cookie(req, "ab")
+
+    if ab == nil then
+        local put = req.headers["put-in-ab-test"]
+        ab = (put ~= nil and put ~= "" and put ~= "0") and "1" or "0"
+        context.cookies[#context.cookies + 1] = "ab=" .. ab
+    end
+
+    context.headers[#context.headers + 1] = "X-AB: " .. ab
+    context.vary[#context.vary + 1] = "X-AB"
+end
+
+return function(req)
+    local context = { headers = {}, vary = {}, cookies = {} }
+
+    set_geo_location(req, context)
+    set_ab_test(req, context)
+
+    local response = { vcl_recv = context.headers, vcl_deliver = {} }
+
+    response.vcl_recv[#response.vcl_recv + 1] =
+        "X-Vary: " .. table.concat(context.vary, ", ")
+
+    for _, c in ipairs(context.cookies) do
+        response.vcl_deliver[#response.vcl_deliver + 1] = "Set-Cookie: " .. c
+    end
+
+    return response
+end
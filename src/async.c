@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vqueue.h"
+#include "vsb.h"
+
+#include "async.h"
+#include "pool.h"
+
+/* One background thread drives every asynchronous transfer through a single
+ * curl multi handle. Workers queue jobs, and a worker waiting on one or more
+ * of them hooks its condvar to the jobs to be woken when one completes. The
+ * loop itself is woken out of curl_multi_wait() through a pipe whenever there
+ * are new jobs or cancellations to pick up. */
+
+VTAILQ_HEAD(async_list, async_job);
+
+static pthread_mutex_t async_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct async_list async_adds = VTAILQ_HEAD_INITIALIZER(async_adds);
+static struct async_list async_cancels = VTAILQ_HEAD_INITIALIZER(async_cancels);
+static CURLM *async_multi = NULL;
+static pthread_t async_thread;
+static int async_pipe[2] = {-1, -1};
+static unsigned async_stop = 0;
+
+static void
+wakeup(void)
+{
+    char c = 0;
+
+    if (write(async_pipe[1], &c, 1) < 0)
+        assert(errno == EAGAIN || errno == EINTR);
+}
+
+static void
+drain(void)
+{
+    char buf[64];
+
+    while (read(async_pipe[0], buf, sizeof buf) > 0)
+        continue;
+}
+
+static void
+job_deref(struct async_job *job)
+{
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+    assert(job->refcnt > 0);
+
+    if (__sync_sub_and_fetch(&job->refcnt, 1) > 0)
+        return;
+
+    free(job->headers);     /* Single block, see build_headers() */
+    if (job->ch)
+        pool_put(job->ch);
+    stream_fini(&job->stream);
+    if (job->body)
+        VSB_delete(job->body);
+    FREE_OBJ(job);
+}
+
+/* Caller must hold async_mtx */
+static void
+job_done(struct async_job *job, CURLcode result)
+{
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+    assert(job->state == ASYNC_RUNNING);
+
+    AZ(curl_multi_remove_handle(async_multi, job->ch));
+    if (job->canceling)
+        VTAILQ_REMOVE(&async_cancels, job, list);
+
+    job->state = ASYNC_DONE;
+    job->result = result;
+    if (job->wake)
+        AZ(pthread_cond_signal(job->wake));
+    job_deref(job);
+}
+
+static void *
+async_loop(void *arg)
+{
+    struct async_job *job;
+    struct curl_waitfd wfd;
+    CURLMsg *msg;
+    int running, n;
+
+    (void)arg;
+
+    while (1) {
+        AZ(pthread_mutex_lock(&async_mtx));
+        if (async_stop) {
+            AZ(pthread_mutex_unlock(&async_mtx));
+            break;
+        }
+        while ((job = VTAILQ_FIRST(&async_adds)) != NULL) {
+            VTAILQ_REMOVE(&async_adds, job, list);
+            assert(job->state == ASYNC_QUEUED);
+            job->state = ASYNC_RUNNING;
+            AZ(curl_multi_add_handle(async_multi, job->ch));
+        }
+        while ((job = VTAILQ_FIRST(&async_cancels)) != NULL)
+            job_done(job, CURLE_ABORTED_BY_CALLBACK);
+        AZ(pthread_mutex_unlock(&async_mtx));
+
+        curl_multi_perform(async_multi, &running);
+
+        while ((msg = curl_multi_info_read(async_multi, &n)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            job = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&job);
+            CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+
+            AZ(pthread_mutex_lock(&async_mtx));
+            job_done(job, msg->data.result);
+            AZ(pthread_mutex_unlock(&async_mtx));
+        }
+
+        wfd.fd = async_pipe[0];
+        wfd.events = CURL_WAIT_POLLIN;
+        wfd.revents = 0;
+        curl_multi_wait(async_multi, &wfd, 1, 1000, &n);
+
+        if (wfd.revents)
+            drain();
+    }
+
+    return NULL;
+}
+
+void
+async_init(void)
+{
+    AZ(pipe(async_pipe));
+    AZ(fcntl(async_pipe[0], F_SETFL, O_NONBLOCK));
+    AZ(fcntl(async_pipe[1], F_SETFL, O_NONBLOCK));
+
+    async_multi = curl_multi_init();
+    AN(async_multi);
+
+    /* Lets http2 transfers to one backend run as streams on one connection */
+    curl_multi_setopt(async_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    async_stop = 0;
+    AZ(pthread_create(&async_thread, NULL, async_loop, NULL));
+}
+
+/* Stops the loop and waits for it. Only jobs the loop had yet to pick up or
+ * to cancel can be left, no request holds one anymore. */
+void
+async_fini(void)
+{
+    struct async_job *job;
+
+    AZ(pthread_mutex_lock(&async_mtx));
+    async_stop = 1;
+    AZ(pthread_mutex_unlock(&async_mtx));
+
+    wakeup();
+    AZ(pthread_join(async_thread, NULL));
+
+    AZ(pthread_mutex_lock(&async_mtx));
+    while ((job = VTAILQ_FIRST(&async_adds)) != NULL) {
+        VTAILQ_REMOVE(&async_adds, job, list);
+        job->state = ASYNC_DONE;
+        job_deref(job);
+    }
+    while ((job = VTAILQ_FIRST(&async_cancels)) != NULL)
+        job_done(job, CURLE_ABORTED_BY_CALLBACK);
+    AZ(pthread_mutex_unlock(&async_mtx));
+
+    AZ(curl_multi_cleanup(async_multi));
+    async_multi = NULL;
+
+    AZ(close(async_pipe[0]));
+    AZ(close(async_pipe[1]));
+    async_pipe[0] = async_pipe[1] = -1;
+}
+
+struct async_job *
+async_job_new(void)
+{
+    struct async_job *job;
+
+    ALLOC_OBJ(job, ASYNC_JOB_MAGIC);
+    AN(job);
+
+    job->refcnt = 1;
+    job->state = ASYNC_NEW;
+    job->script_ttl = -1;
+
+    job->body = VSB_new_auto();
+    CHECK_OBJ_NOTNULL(job->body, VSB_MAGIC);
+
+    return job;
+}
+
+void
+async_submit(struct async_job *job)
+{
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+    assert(job->state == ASYNC_NEW);
+    AN(job->ch);
+
+    curl_easy_setopt(job->ch, CURLOPT_PRIVATE, (char *)job);
+
+    AZ(pthread_mutex_lock(&async_mtx));
+    __sync_add_and_fetch(&job->refcnt, 1);  /* Reference held by the loop */
+    job->state = ASYNC_QUEUED;
+    VTAILQ_INSERT_TAIL(&async_adds, job, list);
+    AZ(pthread_mutex_unlock(&async_mtx));
+
+    wakeup();
+}
+
+/* Returns 1 once the job is done, 0 if timeout (seconds) passed first. A
+ * timeout of 0 or less waits for curl's own timeouts to end the transfer. */
+int
+async_wait(struct async_job *job, double timeout)
+{
+    return (async_wait_any(&job, 1, timeout) >= 0);
+}
+
+/* Same as async_wait() for the first of several jobs to be done, returns its
+ * index, or -1 if timeout passed first */
+int
+async_wait_any(struct async_job * const *jobs, unsigned n, double timeout)
+{
+    pthread_cond_t cond;
+    struct timespec ts;
+    int done = -1;
+
+    AN(jobs);
+    AN(n);
+
+    for (unsigned i = 0; i < n; i++) {
+        CHECK_OBJ_NOTNULL(jobs[i], ASYNC_JOB_MAGIC);
+        assert(jobs[i]->state != ASYNC_NEW);
+    }
+
+    if (timeout > 0) {
+        AZ(clock_gettime(CLOCK_REALTIME, &ts));
+        ts.tv_sec += (time_t)timeout;
+        ts.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+    }
+
+    AZ(pthread_cond_init(&cond, NULL));
+
+    AZ(pthread_mutex_lock(&async_mtx));
+    for (unsigned i = 0; i < n; i++) {
+        AZ(jobs[i]->wake);
+        jobs[i]->wake = &cond;
+    }
+
+    while (1) {
+        for (unsigned i = 0; i < n && done < 0; i++) {
+            if (jobs[i]->state == ASYNC_DONE)
+                done = (int)i;
+        }
+        if (done >= 0)
+            break;
+
+        if (timeout > 0) {
+            if (pthread_cond_timedwait(&cond, &async_mtx, &ts) == ETIMEDOUT)
+                break;
+        }
+        else
+            AZ(pthread_cond_wait(&cond, &async_mtx));
+    }
+
+    for (unsigned i = 0; i < n; i++)
+        jobs[i]->wake = NULL;
+    AZ(pthread_mutex_unlock(&async_mtx));
+
+    AZ(pthread_cond_destroy(&cond));
+
+    return done;
+}
+
+/* Drops the worker's reference, cancelling the transfer if still in flight */
+void
+async_release(struct async_job *job)
+{
+    int wake = 0;
+
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+
+    AZ(pthread_mutex_lock(&async_mtx));
+    if (job->state == ASYNC_QUEUED) {
+        /* Loop never saw it, so drop its reference here */
+        VTAILQ_REMOVE(&async_adds, job, list);
+        job->state = ASYNC_DONE;
+        job_deref(job);
+    }
+    else if (job->state == ASYNC_RUNNING && !job->canceling) {
+        job->canceling = 1;
+        VTAILQ_INSERT_TAIL(&async_cancels, job, list);
+        wake = 1;
+    }
+    job_deref(job);
+    AZ(pthread_mutex_unlock(&async_mtx));
+
+    if (wake)
+        wakeup();
+}
@@ -0,0 +1,58 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "vqueue.h"
+#include "stream.h"
+
+enum async_state {
+    ASYNC_NEW = 0,
+    ASYNC_QUEUED,
+    ASYNC_RUNNING,
+    ASYNC_DONE
+};
+
+/* A transfer handed to the background curl multi loop. The job is shared by
+ * the worker thread that started it and the loop, and freed by whichever of
+ * the two lets go of it last. Everything curl writes to during the transfer
+ * lives in the job, so the worker can abandon it at any time. */
+struct async_job {
+    unsigned magic;
+#define ASYNC_JOB_MAGIC 0x3E9D41B5
+    unsigned                    refcnt;
+    enum async_state            state;
+    unsigned                    canceling;
+    pthread_cond_t              *wake;      /* Signaled when done */
+    CURL                        *ch;
+    struct curl_slist           *headers;
+    struct vsb                  *body;
+    struct stream               stream;     /* Parses body as it arrives */
+    double                      script_ttl;
+    CURLcode                    result;
+    VTAILQ_ENTRY(async_job)     list;
+};
+
+void
+async_init(void);
+
+void
+async_fini(void);
+
+struct async_job *
+async_job_new(void);
+
+void
+async_submit(struct async_job *job);
+
+int
+async_wait(struct async_job *job, double timeout);
+
+int
+async_wait_any(struct async_job * const *jobs, unsigned n, double timeout);
+
+void
+async_release(struct async_job *job);
+
+#endif
@@ -0,0 +1,691 @@
+/* Micro-benchmarks for the parse and apply hot path, run with "make bench".
+ *
+ * proxy.c is included directly so its static functions can be driven without
+ * varnishd. The few varnishd functions it needs (workspace, struct http and
+ * logging) are replaced by minimal versions below that behave like the
+ * Varnish 4.1 originals. Each benchmark reports the time per operation, the
+ * workspace allocations per operation and the heap allocations per operation
+ * made by the vmod code (malloc, calloc and realloc are wrapped by the linker,
+ * see hpbench_LDFLAGS in Makefile.am). */
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "proxy.c"
+
+#include "vtim.h"
+
+#define BENCH_MIN_TIME          0.5     /* Seconds each benchmark runs for */
+#define BENCH_WS_SIZE           (4 * 1024 * 1024)
+#define BENCH_HTTP_MAX          2048
+#define BENCH_BODY_MAX          0x1FFFF
+
+/*--------------------------------------------------------------------
+ * Allocation counters
+ */
+
+static uint64_t heap_allocs;
+static uint64_t ws_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    heap_allocs++;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    heap_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    heap_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+/*--------------------------------------------------------------------
+ * varnishd replacements, see cache_ws.c, cache_http.c and cache_shmlog.c
+ */
+
+#define HTTPH(a, b, c) char b[] = "*" a ":";
+#include "tbl/http_headers.h"
+#undef HTTPH
+
+static void
+http_init_headers(void)
+{
+#define HTTPH(a, b, c) b[0] = (char)strlen(b + 1);
+#include "tbl/http_headers.h"
+#undef HTTPH
+}
+
+void
+VSLb(struct vsl_log *vsl, enum VSL_tag_e tag, const char *fmt, ...)
+{
+    (void)vsl;
+    (void)tag;
+    (void)fmt;
+}
+
+void
+VSLbt(struct vsl_log *vsl, enum VSL_tag_e tag, txt t)
+{
+    (void)vsl;
+    (void)tag;
+    (void)t;
+}
+
+static void
+ws_init(struct ws *ws, char *space, unsigned len)
+{
+    memset(ws, 0, sizeof *ws);
+    ws->magic = WS_MAGIC;
+    strcpy(ws->id, "BCH");
+    ws->s = ws->f = space;
+    ws->e = space + len;
+    ws->r = NULL;
+}
+
+static void
+ws_reset(struct ws *ws, char *mark)
+{
+    CHECK_OBJ_NOTNULL(ws, WS_MAGIC);
+    AZ(ws->r);
+    ws->f = mark;
+    ws->id[0] &= ~0x20;
+}
+
+int
+WS_Overflowed(const struct ws *ws)
+{
+    return (ws->id[0] & 0x20);
+}
+
+void *
+WS_Alloc(struct ws *ws, unsigned bytes)
+{
+    char *r;
+
+    CHECK_OBJ_NOTNULL(ws, WS_MAGIC);
+    AZ(ws->r);
+    ws_allocs++;
+    bytes = PRNDUP(bytes);
+    if (ws->f + bytes > ws->e) {
+        ws->id[0] |= 0x20;
+        return NULL;
+    }
+    r = ws->f;
+    ws->f += bytes;
+    return r;
+}
+
+void *
+WS_Copy(struct ws *ws, const void *str, int len)
+{
+    char *r;
+
+    AN(str);
+    if (len == -1)
+        len = (int)strlen(str) + 1;
+    r = WS_Alloc(ws, (unsigned)len);
+    if (r != NULL)
+        memcpy(r, str, (size_t)len);
+    return r;
+}
+
+char *
+WS_Printf(struct ws *ws, const char *fmt, ...)
+{
+    unsigned u, v;
+    va_list ap;
+    char *p;
+
+    u = WS_Reserve(ws, 0);
+    p = ws->f;
+    va_start(ap, fmt);
+    v = (unsigned)vsnprintf(p, u, fmt, ap);
+    va_end(ap);
+    if (v >= u) {
+        WS_Release(ws, 0);
+        ws->id[0] |= 0x20;
+        return NULL;
+    }
+    WS_Release(ws, v + 1);
+    return p;
+}
+
+unsigned
+WS_Reserve(struct ws *ws, unsigned bytes)
+{
+    unsigned b2;
+
+    CHECK_OBJ_NOTNULL(ws, WS_MAGIC);
+    AZ(ws->r);
+    ws_allocs++;
+    b2 = PRNDDN(ws->e - ws->f);
+    if (bytes != 0 && bytes < b2)
+        b2 = PRNDUP(bytes);
+    if (bytes != 0 && bytes > b2) {
+        ws->id[0] |= 0x20;
+        return 0;
+    }
+    ws->r = ws->f + b2;
+    return b2;
+}
+
+void
+WS_Release(struct ws *ws, unsigned bytes)
+{
+    CHECK_OBJ_NOTNULL(ws, WS_MAGIC);
+    AN(ws->r);
+    assert(bytes <= (unsigned)(ws->e - ws->f));
+    ws->f += PRNDUP(bytes);
+    ws->r = NULL;
+}
+
+void
+WS_ReleaseP(struct ws *ws, char *ptr)
+{
+    CHECK_OBJ_NOTNULL(ws, WS_MAGIC);
+    AN(ws->r);
+    assert(ptr >= ws->f && ptr <= ws->r);
+    ws->f += PRNDUP(ptr - ws->f);
+    ws->r = NULL;
+}
+
+void
+http_SetHeader(struct http *to, const char *hdr)
+{
+    CHECK_OBJ_NOTNULL(to, HTTP_MAGIC);
+    AN(hdr);
+
+    if (to->nhd >= to->shd) {
+        VSLb(to->vsl, SLT_LostHeader, "%s", hdr);
+        return;
+    }
+
+    to->hd[to->nhd].b = hdr;
+    to->hd[to->nhd].e = strchr(hdr, '\0');
+    to->hdf[to->nhd] = 0;
+    to->nhd++;
+}
+
+void
+http_Unset(struct http *hp, const char *hdr)
+{
+    uint16_t u, v;
+
+    CHECK_OBJ_NOTNULL(hp, HTTP_MAGIC);
+
+    for (v = u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
+        if (hp->hd[u].b == NULL)
+            continue;
+        if (is_header(&hp->hd[u], hdr))
+            continue;
+        if (v != u) {
+            hp->hd[v] = hp->hd[u];
+            hp->hdf[v] = hp->hdf[u];
+        }
+        v++;
+    }
+    hp->nhd = v;
+}
+
+/*--------------------------------------------------------------------
+ * Payloads
+ */
+
+struct bench_payload {
+    const char                  *name;
+    char                        *body;
+    size_t                      len;
+    unsigned                    cookies;    /* Cookie headers on the request */
+};
+
+static const char *filler =
+    "0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz"
+    "0123456789abcdef";
+
+static void
+payload_finish(struct bench_payload *p, struct vsb *vsb)
+{
+    AZ(VSB_finish(vsb));
+    p->len = (size_t)VSB_len(vsb);
+    p->body = strdup(VSB_data(vsb));
+    AN(p->body);
+    assert(p->len <= BENCH_BODY_MAX);
+    VSB_delete(vsb);
+}
+
+static void
+payload_small(struct bench_payload *p)
+{
+    struct vsb *vsb = VSB_new_auto();
+    AN(vsb);
+
+    VSB_cat(vsb, "{\"vcl_recv\":[\"x-geo: us\"],"
+        "\"vcl_deliver\":[\"x-cache-tag: home\"]}");
+
+    p->name = "small";
+    payload_finish(p, vsb);
+}
+
+static void
+payload_30(struct bench_payload *p)
+{
+    struct vsb *vsb = VSB_new_auto();
+    AN(vsb);
+
+    VSB_cat(vsb, "{\n    \"vcl_recv\": [\n");
+    for (unsigned i = 0; i < 20; i++)
+        VSB_printf(vsb, "        \"x-recv-%02u: value \\\"%u\\\" at \\/path\\/%u\"%s\n",
+            i, i, i, i < 19 ? "," : "");
+    VSB_cat(vsb, "    ],\n    \"vcl_deliver\": [\n");
+    for (unsigned i = 0; i < 10; i++)
+        VSB_printf(vsb, "        \"x-deliver-%02u: %.40s\"%s\n",
+            i, filler, i < 9 ? "," : "");
+    VSB_cat(vsb, "    ]\n}\n");
+
+    p->name = "30-headers";
+    payload_finish(p, vsb);
+}
+
+/* As close to the 0x1FFFF body limit as whole headers allow */
+static void
+payload_large(struct bench_payload *p)
+{
+    struct vsb *vsb = VSB_new_auto();
+    unsigned i;
+    AN(vsb);
+
+    VSB_cat(vsb, "{\"vcl_recv\":[");
+    for (i = 0; VSB_len(vsb) < BENCH_BODY_MAX - 256; i++)
+        VSB_printf(vsb, "%s\"x-large-%04u: %s\"", i ? "," : "", i, filler);
+    VSB_cat(vsb, "]}");
+
+    p->name = "large";
+    payload_finish(p, vsb);
+}
+
+static void
+payload_cookies(struct bench_payload *p)
+{
+    struct vsb *vsb = VSB_new_auto();
+    AN(vsb);
+
+    VSB_cat(vsb, "{\"vcl_recv\":[");
+    for (unsigned i = 0; i < 20; i++)
+        VSB_printf(vsb, "%s\"Cookie: seg%02u=%.24s\"", i ? "," : "", i, filler);
+    VSB_cat(vsb, ",\"x-user: 12345\"]}");
+
+    p->name = "cookies";
+    p->cookies = 10;
+    payload_finish(p, vsb);
+}
+
+/*--------------------------------------------------------------------
+ * Benchmark state
+ */
+
+struct bench {
+    const struct bench_payload  *payload;
+    struct vrt_ctx              ctx;
+    struct ws                   ws;
+    char                        *space;
+    char                        *compiled;  /* Workspace mark after compile */
+    struct proxy_request        *req;
+    jsmntok_t                   *toks;
+    unsigned                    ntoks;
+    char                        *scratch;
+    struct http                 http_req;
+    struct http                 http_resp;
+    txt                         req_hd[BENCH_HTTP_MAX];
+    unsigned char               req_hdf[BENCH_HTTP_MAX];
+    txt                         resp_hd[BENCH_HTTP_MAX];
+    unsigned char               resp_hdf[BENCH_HTTP_MAX];
+    txt                         base_hd[BENCH_HTTP_MAX];
+    uint16_t                    base_nhd;
+    struct req                  vreq;
+};
+
+static void
+http_setup(struct http *hp, txt *hd, unsigned char *hdf, struct ws *ws)
+{
+    memset(hp, 0, sizeof *hp);
+    hp->magic = HTTP_MAGIC;
+    hp->hd = hd;
+    hp->hdf = hdf;
+    hp->shd = BENCH_HTTP_MAX;
+    hp->ws = ws;
+
+    hd[HTTP_HDR_METHOD].b = "GET";
+    hd[HTTP_HDR_URL].b = "/";
+    hd[HTTP_HDR_PROTO].b = "HTTP/1.1";
+    for (unsigned u = 0; u < HTTP_HDR_FIRST; u++) {
+        if (hd[u].b == NULL)
+            hd[u].b = "";
+        hd[u].e = strchr(hd[u].b, '\0');
+    }
+    hp->nhd = HTTP_HDR_FIRST;
+}
+
+/* The request headers a browser typically sends, plus the payload cookies */
+static void
+http_base(struct bench *b)
+{
+    static const char * const hdrs[] = {
+        "Host: www.example.com",
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) Gecko/20100101",
+        "Accept: text/html,application/xhtml+xml",
+        "Accept-Encoding: gzip, deflate",
+        "Accept-Language: en-US,en;q=0.5",
+        NULL
+    };
+    static char cookies[64][48];
+
+    http_setup(&b->http_req, b->req_hd, b->req_hdf, &b->ws);
+
+    for (unsigned i = 0; hdrs[i] != NULL; i++)
+        http_SetHeader(&b->http_req, hdrs[i]);
+
+    for (unsigned i = 0; i < b->payload->cookies && i < 64; i++) {
+        snprintf(cookies[i], sizeof cookies[i], "Cookie: c%02u=%.24s", i, filler);
+        http_SetHeader(&b->http_req, cookies[i]);
+    }
+
+    memcpy(b->base_hd, b->req_hd, sizeof b->base_hd);
+    b->base_nhd = b->http_req.nhd;
+}
+
+static void
+http_restore(struct bench *b)
+{
+    memcpy(b->req_hd, b->base_hd, b->base_nhd * sizeof *b->req_hd);
+    memset(b->req_hdf, 0, b->base_nhd);
+    b->http_req.nhd = b->base_nhd;
+    b->http_resp.nhd = HTTP_HDR_FIRST;
+}
+
+static void
+bench_setup(struct bench *b, const struct bench_payload *p)
+{
+    unsigned idx = 0, type = 0;
+    int capped = 0;
+
+    memset(b, 0, sizeof *b);
+    b->payload = p;
+    b->space = malloc(BENCH_WS_SIZE);
+    AN(b->space);
+    ws_init(&b->ws, b->space, BENCH_WS_SIZE);
+
+    http_setup(&b->http_resp, b->resp_hd, b->resp_hdf, &b->ws);
+    http_base(b);
+
+    b->vreq.magic = REQ_MAGIC;
+    b->ctx.magic = VRT_CTX_MAGIC;
+    b->ctx.method = VCL_MET_RECV;
+    b->ctx.ws = &b->ws;
+    b->ctx.req = &b->vreq;
+    b->ctx.http_req = &b->http_req;
+    b->ctx.http_resp = &b->http_resp;
+
+    b->req = proxy_create_request(&b->ctx);
+    AN(b->req);
+
+    b->ntoks = (unsigned)p->len / 2 + 1;
+    b->toks = malloc(b->ntoks * sizeof *b->toks);
+    b->scratch = malloc(p->len + 1);
+    AN(b->toks);
+    AN(b->scratch);
+
+    /* Compile once, the benchmarks below restart from parts of this */
+    b->req->ctx = &b->ctx;
+    b->req->body = WS_Copy(&b->ws, p->body, (int)p->len + 1);
+    AN(b->req->body);
+    assert(parse_json(b->req, b->req->body, p->len, b->ntoks, &capped) > 0);
+
+    size_t hdrs_size = b->req->json_toks_len * sizeof(struct proxy_header);
+    b->req->recv_hdrs = WS_Alloc(&b->ws, hdrs_size);
+    b->req->deliver_hdrs = WS_Alloc(&b->ws, hdrs_size);
+    AN(b->req->recv_hdrs);
+    AN(b->req->deliver_hdrs);
+
+    AZ(compile_json(b->req, &idx, &type, 0));
+    b->req->ctx = NULL;
+    b->compiled = b->ws.f;
+}
+
+static void
+bench_teardown(struct bench *b)
+{
+    proxy_release_request(b->req);
+    free(b->toks);
+    free(b->scratch);
+    free(b->space);
+}
+
+/*--------------------------------------------------------------------
+ * Operations
+ */
+
+static void
+op_parse(struct bench *b)
+{
+    jsmn_parser parser;
+
+    jsmn_init(&parser);
+    assert(jsmn_parse(&parser, b->payload->body, b->payload->len, b->toks,
+        b->ntoks) > 0);
+}
+
+/* The same parse with the string scan run() selected */
+static void
+op_scan(struct bench *b)
+{
+    jsmn_parser parser;
+
+    jsmn_init(&parser);
+    assert(jscan_parse(&parser, b->payload->body, b->payload->len, b->toks,
+        b->ntoks) > 0);
+}
+
+/* compile_json() over the already parsed tokens. It terminates and unescapes
+ * the headers in place, so the body copy is restored first, the same copy
+ * parse_body() makes. */
+static void
+op_compile(struct bench *b)
+{
+    struct proxy_request *req = b->req;
+    unsigned idx = 0, type = 0;
+    char *lists = (char *)req->deliver_hdrs;
+
+    ws_reset(&b->ws, lists + PRNDUP(req->json_toks_len *
+        sizeof(struct proxy_header)));
+    memcpy(req->body, b->payload->body, b->payload->len + 1);
+    req->ctx = &b->ctx;
+    req->recv_len = req->deliver_len = 0;
+    req->collect_cookies = 0;
+
+    AZ(compile_json(req, &idx, &type, 0));
+    req->ctx = NULL;
+}
+
+/* The escape check over every header string of the response, and unescape()
+ * for those that have a backslash */
+static void
+op_unescape(struct bench *b)
+{
+    const struct proxy_request *req = b->req;
+    const char *json = b->payload->body;
+    char *p = b->scratch;
+
+    for (int i = 0; i < req->json_toks_len; i++) {
+        const jsmntok_t *t = &req->json_toks[i];
+        size_t len = (size_t)(t->end - t->start);
+
+        if (t->type != JSMN_STRING || memchr(json + t->start, ':', len) == NULL)
+            continue;
+
+        if (memchr(json + t->start, '\\', len) != NULL)
+            AN(unescape(p, json + t->start, len));
+    }
+}
+
+/* proxy_process_request() in vcl_recv and vcl_deliver */
+static void
+op_apply(struct bench *b)
+{
+    ws_reset(&b->ws, b->compiled);
+    http_restore(b);
+
+    b->ctx.method = VCL_MET_RECV;
+    proxy_process_request(&b->ctx, b->req);
+    b->ctx.method = VCL_MET_DELIVER;
+    proxy_process_request(&b->ctx, b->req);
+    b->ctx.method = VCL_MET_RECV;
+}
+
+static void
+op_collect(struct bench *b)
+{
+    ws_reset(&b->ws, b->compiled);
+    http_restore(b);
+
+    collect_header(&b->http_req, H_Cookie, ';');
+}
+
+/*--------------------------------------------------------------------
+ * Driver
+ */
+
+struct bench_op {
+    const char                  *name;
+    void                        (*fn)(struct bench *);
+    unsigned                    cookies_only;
+    enum jscan_impl             scan;       /* Skipped if not supported */
+};
+
+static const struct bench_op ops[] = {
+    { "jsmn_parse",             op_parse,       0, JSCAN_AUTO },
+    { "jscan_scalar",           op_scan,        0, JSCAN_SCALAR },
+    { "jscan_sse2",             op_scan,        0, JSCAN_SSE2 },
+    { "jscan_avx2",             op_scan,        0, JSCAN_AVX2 },
+    { "compile",                op_compile,     0, JSCAN_AUTO },
+    { "unescape",               op_unescape,    0, JSCAN_AUTO },
+    { "apply",                  op_apply,       0, JSCAN_AUTO },
+    { "collect_header",         op_collect,     1, JSCAN_AUTO },
+};
+
+/* Every scan must give the tokens jsmn gives */
+static void
+check_scan(const struct bench *b)
+{
+    jsmntok_t *toks = malloc(b->ntoks * sizeof *toks);
+    jsmn_parser p1, p2;
+    int r;
+    AN(toks);
+
+    jsmn_init(&p1);
+    r = jsmn_parse(&p1, b->payload->body, b->payload->len, b->toks, b->ntoks);
+    assert(r > 0);
+
+    for (unsigned i = JSCAN_SCALAR; i <= JSCAN_AVX2; i++) {
+        if (!jscan_select(i))
+            continue;
+        jsmn_init(&p2);
+        assert(jscan_parse(&p2, b->payload->body, b->payload->len, toks,
+            b->ntoks) == r);
+        assert(p2.toknext == p1.toknext);
+        AZ(memcmp(toks, b->toks, p1.toknext * sizeof *toks));
+    }
+
+    AN(jscan_select(JSCAN_AUTO));
+    free(toks);
+}
+
+/* Doubles the iteration count until a run takes at least BENCH_MIN_TIME */
+static void
+run(struct bench *b, const struct bench_op *op)
+{
+    uint64_t n, heap, ws;
+    double t;
+
+    for (n = 1;; n *= 2) {
+        heap = heap_allocs;
+        ws = ws_allocs;
+        t = VTIM_mono();
+
+        for (uint64_t i = 0; i < n; i++)
+            op->fn(b);
+
+        t = VTIM_mono() - t;
+        if (t >= BENCH_MIN_TIME)
+            break;
+    }
+
+    printf("%-12s %-16s %12.1f ns/op %8.2f ws allocs/op %8.2f heap allocs/op\n",
+        b->payload->name, op->name, t * 1e9 / n,
+        (double)(ws_allocs - ws) / n, (double)(heap_allocs - heap) / n);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct bench_payload payloads[4];
+    struct bench *b;
+
+    memset(payloads, 0, sizeof payloads);
+    http_init_headers();
+    stats_init();
+
+    payload_small(&payloads[0]);
+    payload_30(&payloads[1]);
+    payload_large(&payloads[2]);
+    payload_cookies(&payloads[3]);
+
+    b = malloc(sizeof *b);
+    AN(b);
+
+    printf("# jscan: %s\n", jscan_name());
+
+    for (unsigned i = 0; i < 4; i++) {
+        /* Optionally only run the payloads named on the command line */
+        if (argc > 1) {
+            int found = 0;
+            for (int a = 1; a < argc; a++)
+                found |= !strcmp(argv[a], payloads[i].name);
+            if (!found)
+                continue;
+        }
+
+        printf("# %s: %zu bytes\n", payloads[i].name, payloads[i].len);
+        bench_setup(b, &payloads[i]);
+
+        check_scan(b);
+
+        for (unsigned o = 0; o < sizeof ops / sizeof ops[0]; o++) {
+            if (ops[o].cookies_only && payloads[i].cookies == 0)
+                continue;
+            if (!jscan_select(ops[o].scan))
+                continue;
+            run(b, &ops[o]);
+        }
+        AN(jscan_select(JSCAN_AUTO));
+
+        bench_teardown(b);
+        free(payloads[i].body);
+    }
+
+    free(b);
+
+    return 0;
+}
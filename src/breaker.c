@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vqueue.h"
+#include "vtim.h"
+
+#include "breaker.h"
+
+/* Circuit breakers, one per backend the web script is called on. A breaker
+ * counts calls and failures (errors, 5xx or calls slower than max_latency)
+ * over a rolling window. Once the failure rate passes the limit it opens and
+ * every call fails fast until the cooldown is over. Then a single probe call
+ * is let through (half-open), which closes or reopens the breaker. */
+
+enum breaker_state {
+    BREAKER_CLOSED = 0,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN
+};
+
+struct breaker {
+    unsigned magic;
+#define BREAKER_MAGIC 0x41F6A2D9
+    const void                  *key;
+    const struct breakers       *bs;
+    pthread_mutex_t             mtx;
+    enum breaker_state          state;
+    unsigned                    calls;
+    unsigned                    fails;
+    unsigned                    probing;
+    double                      window_start;
+    double                      opened;
+    VTAILQ_ENTRY(breaker)       list;
+};
+
+struct breakers {
+    unsigned magic;
+#define BREAKERS_MAGIC 0x0B7E35C8
+    double                      rate;
+    unsigned                    min_calls;
+    double                      max_latency;
+    double                      cooldown;
+    pthread_mutex_t             mtx;
+    VTAILQ_HEAD(, breaker)      list;
+};
+
+static struct breaker_stats stats;
+
+struct breakers *
+breakers_new(double rate, unsigned min_calls, double max_latency,
+             double cooldown)
+{
+    struct breakers *bs;
+
+    ALLOC_OBJ(bs, BREAKERS_MAGIC);
+    AN(bs);
+
+    bs->rate = rate;
+    bs->min_calls = min_calls ? min_calls : 1;
+    bs->max_latency = max_latency;
+    bs->cooldown = cooldown;
+    AZ(pthread_mutex_init(&bs->mtx, NULL));
+    VTAILQ_INIT(&bs->list);
+
+    return bs;
+}
+
+void
+breakers_free(struct breakers *bs)
+{
+    struct breaker *b, *b2;
+
+    if (bs == NULL)
+        return;
+
+    CHECK_OBJ_NOTNULL(bs, BREAKERS_MAGIC);
+
+    VTAILQ_FOREACH_SAFE(b, &bs->list, list, b2) {
+        VTAILQ_REMOVE(&bs->list, b, list);
+        AZ(pthread_mutex_destroy(&b->mtx));
+        FREE_OBJ(b);
+    }
+
+    AZ(pthread_mutex_destroy(&bs->mtx));
+    FREE_OBJ(bs);
+}
+
+/* A VCL only has a handful of backends, so a list is all we need */
+struct breaker *
+breaker_get(struct breakers *bs, const void *key)
+{
+    struct breaker *b;
+
+    CHECK_OBJ_NOTNULL(bs, BREAKERS_MAGIC);
+    AN(key);
+
+    AZ(pthread_mutex_lock(&bs->mtx));
+    VTAILQ_FOREACH(b, &bs->list, list) {
+        if (b->key == key)
+            break;
+    }
+
+    if (b == NULL) {
+        ALLOC_OBJ(b, BREAKER_MAGIC);
+        AN(b);
+        b->key = key;
+        b->bs = bs;
+        b->state = BREAKER_CLOSED;
+        b->window_start = VTIM_mono();
+        AZ(pthread_mutex_init(&b->mtx, NULL));
+        VTAILQ_INSERT_TAIL(&bs->list, b, list);
+    }
+    AZ(pthread_mutex_unlock(&bs->mtx));
+
+    return b;
+}
+
+/* Caller must hold the breaker lock */
+static void
+trip(struct breaker *b, double now)
+{
+    b->state = BREAKER_OPEN;
+    b->opened = now;
+    b->probing = 0;
+    __sync_add_and_fetch(&stats.opens, 1);
+}
+
+int
+breaker_allow(struct breaker *b)
+{
+    int allow = 1;
+
+    CHECK_OBJ_NOTNULL(b, BREAKER_MAGIC);
+
+    double now = VTIM_mono();
+
+    AZ(pthread_mutex_lock(&b->mtx));
+    if (b->state == BREAKER_OPEN && now - b->opened >= b->bs->cooldown) {
+        b->state = BREAKER_HALF_OPEN;
+        b->probing = 0;
+    }
+
+    if (b->state == BREAKER_OPEN)
+        allow = 0;
+    else if (b->state == BREAKER_HALF_OPEN) {
+        if (b->probing)
+            allow = 0;
+        else {
+            b->probing = 1;
+            __sync_add_and_fetch(&stats.probes, 1);
+        }
+    }
+    AZ(pthread_mutex_unlock(&b->mtx));
+
+    if (!allow)
+        __sync_add_and_fetch(&stats.rejects, 1);
+
+    return allow;
+}
+
+void
+breaker_report(struct breaker *b, int ok, double latency)
+{
+    CHECK_OBJ_NOTNULL(b, BREAKER_MAGIC);
+
+    double now = VTIM_mono();
+
+    if (b->bs->max_latency > 0 && latency > b->bs->max_latency)
+        ok = 0;
+
+    AZ(pthread_mutex_lock(&b->mtx));
+    if (b->state == BREAKER_HALF_OPEN) {
+        if (ok) {
+            b->state = BREAKER_CLOSED;
+            b->calls = b->fails = 0;
+            b->window_start = now;
+        }
+        else
+            trip(b, now);
+    }
+    else if (b->state == BREAKER_CLOSED) {
+        if (now - b->window_start > BREAKER_WINDOW) {
+            b->calls = b->fails = 0;
+            b->window_start = now;
+        }
+
+        b->calls++;
+        if (!ok)
+            b->fails++;
+
+        if (b->calls >= b->bs->min_calls &&
+            b->fails >= b->bs->rate * b->calls)
+            trip(b, now);
+    }
+    AZ(pthread_mutex_unlock(&b->mtx));
+}
+
+void
+breaker_stats(struct breaker_stats *s)
+{
+    AN(s);
+
+    s->opens = __sync_add_and_fetch(&stats.opens, 0);
+    s->rejects = __sync_add_and_fetch(&stats.rejects, 0);
+    s->probes = __sync_add_and_fetch(&stats.probes, 0);
+}
@@ -0,0 +1,36 @@
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include <stdint.h>
+
+#define BREAKER_WINDOW          10.0    /* Seconds of calls the rate covers */
+
+struct breakers;
+struct breaker;
+
+struct breaker_stats {
+    uint64_t                    opens;      /* Closed or half-open to open */
+    uint64_t                    rejects;    /* Calls failed fast */
+    uint64_t                    probes;     /* Half-open trial calls */
+};
+
+struct breakers *
+breakers_new(double rate, unsigned min_calls, double max_latency,
+             double cooldown);
+
+void
+breakers_free(struct breakers *bs);
+
+struct breaker *
+breaker_get(struct breakers *bs, const void *key);
+
+int
+breaker_allow(struct breaker *b);
+
+void
+breaker_report(struct breaker *b, int ok, double latency);
+
+void
+breaker_stats(struct breaker_stats *stats);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <curl/curl.h>
+
+#include "proxy.h"
+#include "errlog.h"
+
+/* Errors are logged to the vsl of the request right away, but to syslog only
+ * as a periodic summary. Worker threads just bump lock-free counters, and a
+ * background thread writes one line per error class, curl code and http
+ * status that occurred since the last summary. This keeps an outage of the
+ * web script from turning into a flood of blocking syslog() calls. */
+
+struct errlog_class {
+    const char                  *prefix;    /* Start of the error message */
+    const char                  *name;      /* Used by headerproxy.stat() */
+};
+
+static const struct errlog_class classes[] = {
+    { "curl err",               "curl" },
+    { "parse",                  "parse" },
+    { "json error",             "json" },
+    { "breaker",                "breaker" },
+    { "async",                  "async" },
+    { "flight",                 "flight" },
+    { "notify",                 "notify" },
+    { "budget",                 "budget" },
+    { "sidecar",                "sidecar" },
+    { "lua",                    "lua" },
+    { "no backends available",  "backend" },
+    { "",                       "other" },  /* Must be last */
+};
+
+#define NCLASSES                (sizeof classes / sizeof classes[0])
+#define NSTATUSES               600
+
+static uint64_t class_counts[NCLASSES];
+static uint64_t curl_counts[CURL_LAST];
+static uint64_t status_counts[NSTATUSES];
+
+static uint64_t
+delta(uint64_t *cur, uint64_t *last)
+{
+    uint64_t v = __sync_add_and_fetch(cur, 0);
+    uint64_t d = v - *last;
+
+    *last = v;
+    return d;
+}
+
+static pthread_mutex_t errlog_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t errlog_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t errlog_thread;
+static unsigned errlog_stop = 0;
+
+static void
+summarize(void)
+{
+    static uint64_t last_class[NCLASSES];
+    static uint64_t last_curl[CURL_LAST];
+    static uint64_t last_status[NSTATUSES];
+    uint64_t d;
+
+    for (unsigned i = 0; i < NCLASSES; i++) {
+        if ((d = delta(&class_counts[i], &last_class[i])) > 0)
+            syslog(LOG_ERR, PROXY_NAME ": %ju %s errors in last %ds",
+                (uintmax_t)d, classes[i].name, ERRLOG_INTERVAL);
+    }
+
+    for (unsigned i = 0; i < CURL_LAST; i++) {
+        if ((d = delta(&curl_counts[i], &last_curl[i])) > 0)
+            syslog(LOG_ERR, PROXY_NAME ": %ju x curl err: %s",
+                (uintmax_t)d, curl_easy_strerror((CURLcode)i));
+    }
+
+    for (unsigned i = 0; i < NSTATUSES; i++) {
+        if ((d = delta(&status_counts[i], &last_status[i])) > 0)
+            syslog(LOG_ERR, PROXY_NAME ": %ju x curl err: %u response",
+                (uintmax_t)d, i);
+    }
+}
+
+/* Sleeps on a condvar rather than in sleep(), so that errlog_fini() does not
+ * wait out the interval. The errors since the last summary are written
+ * before the thread exits. */
+static void *
+errlog_loop(void *arg)
+{
+    struct timespec ts;
+    unsigned stop = 0;
+
+    (void)arg;
+
+    while (!stop) {
+        AZ(clock_gettime(CLOCK_REALTIME, &ts));
+        ts.tv_sec += ERRLOG_INTERVAL;
+
+        AZ(pthread_mutex_lock(&errlog_mtx));
+        while (!errlog_stop &&
+            pthread_cond_timedwait(&errlog_cond, &errlog_mtx, &ts) != ETIMEDOUT)
+            continue;
+        stop = errlog_stop;
+        AZ(pthread_mutex_unlock(&errlog_mtx));
+
+        summarize();
+    }
+
+    return NULL;
+}
+
+void
+errlog_init(void)
+{
+    errlog_stop = 0;
+    AZ(pthread_create(&errlog_thread, NULL, errlog_loop, NULL));
+}
+
+void
+errlog_fini(void)
+{
+    AZ(pthread_mutex_lock(&errlog_mtx));
+    errlog_stop = 1;
+    AZ(pthread_cond_signal(&errlog_cond));
+    AZ(pthread_mutex_unlock(&errlog_mtx));
+
+    AZ(pthread_join(errlog_thread, NULL));
+}
+
+/* Classifies the error by the start of its message format */
+void
+errlog_count(const char *fmt)
+{
+    unsigned i;
+
+    AN(fmt);
+
+    for (i = 0; i < NCLASSES - 1; i++) {
+        if (strncmp(fmt, classes[i].prefix, strlen(classes[i].prefix)) == 0)
+            break;
+    }
+
+    __sync_add_and_fetch(&class_counts[i], 1);
+}
+
+void
+errlog_curl(int code)
+{
+    if (code >= 0 && code < CURL_LAST)
+        __sync_add_and_fetch(&curl_counts[code], 1);
+}
+
+void
+errlog_status(long status)
+{
+    if (status < 0 || status >= NSTATUSES)
+        status = 0;
+
+    __sync_add_and_fetch(&status_counts[status], 1);
+}
+
+/* Totals since startup, "errors.<class>" or "errors.http" */
+long
+errlog_stat(const char *name)
+{
+    uint64_t sum = 0;
+
+    AN(name);
+
+    if (strcmp(name, "http") == 0) {
+        for (unsigned i = 0; i < NSTATUSES; i++)
+            sum += __sync_add_and_fetch(&status_counts[i], 0);
+        return (long)sum;
+    }
+
+    for (unsigned i = 0; i < NCLASSES; i++) {
+        if (strcmp(name, classes[i].name) == 0)
+            return (long)__sync_add_and_fetch(&class_counts[i], 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef ERRLOG_H
+#define ERRLOG_H
+
+#define ERRLOG_INTERVAL         10      /* Seconds between syslog summaries */
+
+void
+errlog_init(void);
+
+void
+errlog_fini(void);
+
+void
+errlog_count(const char *fmt);
+
+void
+errlog_curl(int code);
+
+void
+errlog_status(long status);
+
+long
+errlog_stat(const char *name);
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vqueue.h"
+
+#include "flight.h"
+
+/* Single-flight coalescing of identical concurrent calls. The first call for
+ * a key becomes the leader and makes the web script call, every call for the
+ * same key that arrives while it is in flight follows and waits for the
+ * leader's result instead of calling the script itself. The flight leaves the
+ * table as soon as the leader is done, nothing is kept afterwards. Flights are
+ * reference counted, so a follower that gave up never blocks the leader. */
+struct flight {
+    unsigned magic;
+#define FLIGHT_MAGIC 0x7B3C19E4
+    unsigned                    refcnt;
+    unsigned                    done;
+    uint32_t                    hash;
+    char                        *key;
+    void                        *data;      /* NULL when the leader failed */
+    size_t                      len;
+    pthread_cond_t              cond;
+    struct flight_stripe        *stripe;
+    VLIST_ENTRY(flight)         chain;
+};
+
+VLIST_HEAD(flight_chain, flight);
+
+struct flight_stripe {
+    pthread_mutex_t             mtx;
+    struct flight_chain         buckets[FLIGHT_BUCKETS];
+};
+
+static struct flight_stripe stripes[FLIGHT_STRIPES];
+static struct flight_stats stats;
+
+/* FNV-1a */
+static uint32_t
+hash_key(const char *key)
+{
+    uint32_t h = 2166136261U;
+
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static struct flight_chain *
+get_bucket(struct flight_stripe *s, uint32_t hash)
+{
+    return &s->buckets[(hash / FLIGHT_STRIPES) % FLIGHT_BUCKETS];
+}
+
+void
+flight_init(void)
+{
+    for (unsigned i = 0; i < FLIGHT_STRIPES; i++) {
+        AZ(pthread_mutex_init(&stripes[i].mtx, NULL));
+        for (unsigned b = 0; b < FLIGHT_BUCKETS; b++)
+            VLIST_INIT(&stripes[i].buckets[b]);
+    }
+}
+
+/* Returns the flight for key with a reference held, and sets leader when the
+ * caller created it and must call flight_done() */
+struct flight *
+flight_join(const char *key, int *leader)
+{
+    struct flight *f;
+
+    AN(key);
+    AN(leader);
+
+    uint32_t hash = hash_key(key);
+    struct flight_stripe *s = &stripes[hash % FLIGHT_STRIPES];
+    struct flight_chain *chain = get_bucket(s, hash);
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    VLIST_FOREACH(f, chain, chain) {
+        if (f->hash == hash && strcmp(f->key, key) == 0)
+            break;
+    }
+
+    if (f != NULL) {
+        CHECK_OBJ(f, FLIGHT_MAGIC);
+        f->refcnt++;
+        *leader = 0;
+        __sync_add_and_fetch(&stats.followers, 1);
+    }
+    else {
+        ALLOC_OBJ(f, FLIGHT_MAGIC);
+        AN(f);
+        f->key = strdup(key);
+        AN(f->key);
+        f->hash = hash;
+        f->refcnt = 1;
+        f->stripe = s;
+        AZ(pthread_cond_init(&f->cond, NULL));
+        VLIST_INSERT_HEAD(chain, f, chain);
+        *leader = 1;
+        __sync_add_and_fetch(&stats.leaders, 1);
+    }
+    AZ(pthread_mutex_unlock(&s->mtx));
+
+    return f;
+}
+
+/* Publishes the leader's result, taking over data, and wakes the followers.
+ * A NULL data tells them the leader failed. */
+void
+flight_done(struct flight *f, void *data, size_t len)
+{
+    CHECK_OBJ_NOTNULL(f, FLIGHT_MAGIC);
+    struct flight_stripe *s = f->stripe;
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    AZ(f->done);
+    f->done = 1;
+    f->data = data;
+    f->len = data ? len : 0;
+    VLIST_REMOVE(f, chain);
+    AZ(pthread_cond_broadcast(&f->cond));
+    AZ(pthread_mutex_unlock(&s->mtx));
+}
+
+/* Waits up to timeout for the leader, returns 1 when it is done */
+int
+flight_wait(struct flight *f, double timeout)
+{
+    struct timespec ts;
+    int done;
+
+    CHECK_OBJ_NOTNULL(f, FLIGHT_MAGIC);
+    struct flight_stripe *s = f->stripe;
+
+    AZ(clock_gettime(CLOCK_REALTIME, &ts));
+    ts.tv_sec += (time_t)timeout;
+    ts.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    while (!f->done) {
+        if (pthread_cond_timedwait(&f->cond, &s->mtx, &ts) == ETIMEDOUT)
+            break;
+    }
+    done = f->done;
+    if (!done)
+        __sync_add_and_fetch(&stats.timeouts, 1);
+    else if (f->data == NULL)
+        __sync_add_and_fetch(&stats.failures, 1);
+    AZ(pthread_mutex_unlock(&s->mtx));
+
+    return done;
+}
+
+/* Only valid after flight_wait() returned 1, until the flight is released */
+const void *
+flight_data(const struct flight *f, size_t *len)
+{
+    CHECK_OBJ_NOTNULL(f, FLIGHT_MAGIC);
+    AN(f->done);
+    AN(len);
+
+    *len = f->len;
+    return f->data;
+}
+
+void
+flight_release(struct flight *f)
+{
+    unsigned refcnt;
+
+    CHECK_OBJ_NOTNULL(f, FLIGHT_MAGIC);
+    struct flight_stripe *s = f->stripe;
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    assert(f->refcnt > 0);
+    refcnt = --f->refcnt;
+    AZ(pthread_mutex_unlock(&s->mtx));
+
+    if (refcnt > 0)
+        return;
+
+    /* The leader always lands before letting go */
+    AN(f->done);
+    AZ(pthread_cond_destroy(&f->cond));
+    free(f->data);
+    free(f->key);
+    FREE_OBJ(f);
+}
+
+void
+flight_stats(struct flight_stats *st)
+{
+    AN(st);
+
+    st->leaders = __sync_add_and_fetch(&stats.leaders, 0);
+    st->followers = __sync_add_and_fetch(&stats.followers, 0);
+    st->timeouts = __sync_add_and_fetch(&stats.timeouts, 0);
+    st->failures = __sync_add_and_fetch(&stats.failures, 0);
+}
@@ -0,0 +1,40 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FLIGHT_STRIPES          16
+#define FLIGHT_BUCKETS          64      /* Hash buckets per stripe */
+
+struct flight;
+
+struct flight_stats {
+    uint64_t                    leaders;    /* Calls made for a key */
+    uint64_t                    followers;  /* Calls that joined one */
+    uint64_t                    timeouts;   /* Followers that gave up */
+    uint64_t                    failures;   /* Followers of a failed leader */
+};
+
+void
+flight_init(void);
+
+struct flight *
+flight_join(const char *key, int *leader);
+
+void
+flight_done(struct flight *f, void *data, size_t len);
+
+int
+flight_wait(struct flight *f, double timeout);
+
+const void *
+flight_data(const struct flight *f, size_t *len);
+
+void
+flight_release(struct flight *f);
+
+void
+flight_stats(struct flight_stats *stats);
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+
+#include "hdrset.h"
+
+struct hdrset_entry {
+    uint32_t                    hash;
+    unsigned                    len;
+    char                        *name;
+};
+
+/* Open addressing table, sized to a power of two at least twice the number
+ * of names so probes stay short. Lookups never allocate. */
+struct hdrset {
+    unsigned magic;
+#define HDRSET_MAGIC 0x7C14D0E3
+    unsigned                    len;
+    unsigned                    mask;
+    struct hdrset_entry         *entries;
+};
+
+static int
+is_sep(char c)
+{
+    return (c == ',' || isspace((unsigned char)c));
+}
+
+/* FNV-1a over the lowercased name */
+uint32_t
+hdrset_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261U;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint32_t)tolower((unsigned char)name[i]);
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static void
+insert(struct hdrset *set, const char *name, size_t len)
+{
+    uint32_t hash = hdrset_hash(name, len);
+    unsigned i = hash & set->mask;
+
+    while (set->entries[i].name != NULL) {
+        if (set->entries[i].hash == hash && set->entries[i].len == len &&
+            strncasecmp(set->entries[i].name, name, len) == 0)
+            return;
+        i = (i + 1) & set->mask;
+    }
+
+    set->entries[i].hash = hash;
+    set->entries[i].len = (unsigned)len;
+    set->entries[i].name = strndup(name, len);
+    AN(set->entries[i].name);
+    set->len++;
+}
+
+struct hdrset *
+hdrset_new(const char *list)
+{
+    struct hdrset *set;
+    const char *p, *b;
+    unsigned n = 0, size = 8;
+
+    AN(list);
+
+    for (p = list; *p; ) {
+        while (*p && is_sep(*p))
+            p++;
+        if (*p == '\0')
+            break;
+        n++;
+        while (*p && !is_sep(*p))
+            p++;
+    }
+
+    while (size < n * 2)
+        size <<= 1;
+
+    ALLOC_OBJ(set, HDRSET_MAGIC);
+    AN(set);
+    set->mask = size - 1;
+    set->entries = calloc(size, sizeof *set->entries);
+    AN(set->entries);
+
+    for (p = list; *p; ) {
+        while (*p && is_sep(*p))
+            p++;
+        if (*p == '\0')
+            break;
+        b = p;
+        while (*p && !is_sep(*p) && *p != ':')
+            p++;
+        if (p > b)
+            insert(set, b, (size_t)(p - b));
+        while (*p && !is_sep(*p))
+            p++;
+    }
+
+    return set;
+}
+
+void
+hdrset_free(struct hdrset *set)
+{
+    if (set == NULL)
+        return;
+
+    CHECK_OBJ_NOTNULL(set, HDRSET_MAGIC);
+
+    for (unsigned i = 0; i <= set->mask; i++)
+        free(set->entries[i].name);
+    free(set->entries);
+    FREE_OBJ(set);
+}
+
+unsigned
+hdrset_len(const struct hdrset *set)
+{
+    CHECK_OBJ_NOTNULL(set, HDRSET_MAGIC);
+    return set->len;
+}
+
+int
+hdrset_match(const struct hdrset *set, const char *name, size_t len)
+{
+    CHECK_OBJ_NOTNULL(set, HDRSET_MAGIC);
+
+    uint32_t hash = hdrset_hash(name, len);
+    unsigned i = hash & set->mask;
+
+    while (set->entries[i].name != NULL) {
+        if (set->entries[i].hash == hash && set->entries[i].len == len &&
+            strncasecmp(set->entries[i].name, name, len) == 0)
+            return 1;
+        i = (i + 1) & set->mask;
+    }
+
+    return 0;
+}
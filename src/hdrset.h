@@ -0,0 +1,26 @@
+#ifndef HDRSET_H
+#define HDRSET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Case insensitive set of header names, compiled once from a comma and/or
+ * space separated list such as "Cookie, User-Agent". */
+struct hdrset;
+
+struct hdrset *
+hdrset_new(const char *list);
+
+void
+hdrset_free(struct hdrset *set);
+
+unsigned
+hdrset_len(const struct hdrset *set);
+
+int
+hdrset_match(const struct hdrset *set, const char *name, size_t len);
+
+uint32_t
+hdrset_hash(const char *name, size_t len);
+
+#endif
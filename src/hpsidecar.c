@@ -0,0 +1,208 @@
+/* Reference sidecar for the shared memory transport, used by the tests and as
+ * a starting point for a real script runtime. It creates the ring file and
+ * answers every request in the compact format with two request headers:
+ *
+ *     X-Sidecar: <script path>
+ *     X-Sidecar-Url: <url>
+ *
+ * Usage: hpsidecar [-d] [-t idle] path
+ *
+ *     -d       go to the background once the file is ready
+ *     -t idle  exit after idle seconds without requests, 0 (the default)
+ *              runs forever
+ *
+ * The file is created anew on every start. A Varnish that mapped the file of
+ * an earlier run finds the inode changed and maps the new one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmring.h"
+
+static struct shmring_hdr *
+create(const char *path)
+{
+    struct shmring_hdr *hdr;
+    int fd;
+
+    (void)unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    if (ftruncate(fd, sizeof *hdr) != 0) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    hdr = mmap(NULL, sizeof *hdr, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    (void)close(fd);
+
+    /* The file is zero filled, so every slot is SHMRING_FREE */
+    hdr->version = SHMRING_VERSION;
+    hdr->nslots = SHMRING_SLOTS;
+    __atomic_store_n(&hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+    return hdr;
+}
+
+/* Appends one compact record, returns 0 when the response is full */
+static int
+record(struct shmring_slot *slot, const char *name, const char *value,
+       size_t vlen)
+{
+    size_t hlen = strlen(name) + 2 + vlen;
+    size_t room = SHMRING_RESP_MAX - slot->resp_len;
+    int n;
+
+    n = snprintf(slot->resp + slot->resp_len, room, "R %zu %s: ", hlen, name);
+    if (n < 0 || (size_t)n + vlen + 1 > room)
+        return 0;
+
+    memcpy(slot->resp + slot->resp_len + n, value, vlen);
+    slot->resp_len += n + vlen;
+    slot->resp[slot->resp_len++] = '\n';
+    return 1;
+}
+
+/* Sets *line to the next line of the request, returns its length or -1 at
+ * the end */
+static long
+next_line(const struct shmring_slot *slot, size_t *pos, const char **line)
+{
+    const char *p, *nl;
+
+    if (*pos >= slot->req_len)
+        return -1;
+
+    p = slot->req + *pos;
+    nl = memchr(p, '\n', slot->req_len - *pos);
+    if (nl == NULL)
+        nl = slot->req + slot->req_len;
+
+    *line = p;
+    *pos = nl - slot->req + 1;
+    return nl - p;
+}
+
+static void
+answer(struct shmring_slot *slot)
+{
+    const char *path = "", *method = "", *url = "";
+    long plen, mlen, ulen;
+    size_t pos = 0;
+
+    plen = next_line(slot, &pos, &path);
+    mlen = next_line(slot, &pos, &method);
+    ulen = next_line(slot, &pos, &url);
+    (void)mlen;
+
+    slot->resp_len = 0;
+    slot->type = SHMRING_TYPE_COMPACT;
+    if (plen < 0 || ulen < 0) {
+        slot->status = 400;
+        return;
+    }
+
+    slot->status = 200;
+    if (!record(slot, "X-Sidecar", path, plen) ||
+        !record(slot, "X-Sidecar-Url", url, ulen))
+        slot->status = 500;
+}
+
+static void
+finish(struct shmring_slot *slot)
+{
+    /* A worker that timed out left the slot to us */
+    if (!__sync_bool_compare_and_swap(&slot->state, SHMRING_SUBMITTED,
+        SHMRING_DONE)) {
+        __atomic_store_n(&slot->state, SHMRING_FREE, __ATOMIC_RELEASE);
+        return;
+    }
+
+    shmring_futex_wake(&slot->state, 1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct shmring_hdr *hdr;
+    struct timespec rel;
+    int opt, background = 0;
+    long idle = 0;
+    time_t last;
+
+    while ((opt = getopt(argc, argv, "dt:")) != -1) {
+        switch (opt) {
+        case 'd':
+            background = 1;
+            break;
+        case 't':
+            idle = strtol(optarg, NULL, 10);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1)
+        goto usage;
+
+    hdr = create(argv[optind]);
+
+    if (background) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid > 0)
+            return 0;
+        (void)setsid();
+    }
+
+    last = time(NULL);
+    while (1) {
+        uint32_t head = __atomic_load_n(&hdr->sq_head, __ATOMIC_ACQUIRE);
+
+        if (head == hdr->sq_tail) {
+            if (idle > 0 && time(NULL) - last >= idle)
+                break;
+            rel.tv_sec = 1;
+            rel.tv_nsec = 0;
+            (void)shmring_futex_wait(&hdr->sq_head, head, &rel);
+            continue;
+        }
+
+        /* Single consumer, the tail is ours */
+        while (hdr->sq_tail != head) {
+            uint32_t n = hdr->sq[hdr->sq_tail % SHMRING_SLOTS];
+
+            __atomic_store_n(&hdr->sq_tail, hdr->sq_tail + 1, __ATOMIC_RELEASE);
+            if (n >= SHMRING_SLOTS)
+                continue;
+
+            answer(&hdr->slots[n]);
+            finish(&hdr->slots[n]);
+        }
+        last = time(NULL);
+    }
+
+    (void)unlink(argv[optind]);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-d] [-t idle] path\n", argv[0]);
+    return 2;
+}
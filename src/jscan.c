@@ -0,0 +1,404 @@
+/*
+ * Derived from jsmn.c, covered by license ../LICENSE_JSMN
+ */
+
+#include <stdlib.h>
+
+#include "vdef.h"
+#include "vas.h"
+
+#include "jscan.h"
+
+/* jsmn_parse() with the strings scanned in vector steps. Header values make
+ * up most of a web script response and jsmn looks at them a byte at a time,
+ * but all a string needs is the next quote, backslash or NUL, which SSE2 and
+ * AVX2 find 16 or 32 bytes per compare. Everything outside the strings is
+ * short and is parsed as jsmn does, so the tokens are the same. */
+
+typedef const char *scan_f(const char *p, const char *e);
+typedef int string_f(jsmn_parser *parser, const char *js, size_t len,
+    jsmntok_t *tokens, unsigned num_tokens);
+
+/*--------------------------------------------------------------------
+ * The parser, as jsmn.c without JSMN_STRICT and JSMN_PARENT_LINKS. The
+ * position is kept in a local while looping, as the compiler must otherwise
+ * assume that any store through a char pointer changes parser->pos.
+ */
+
+static jsmntok_t *
+alloc_token(jsmn_parser *parser, jsmntok_t *tokens, unsigned num_tokens)
+{
+    jsmntok_t *tok;
+
+    if (parser->toknext >= num_tokens)
+        return NULL;
+
+    tok = &tokens[parser->toknext++];
+    tok->start = tok->end = -1;
+    tok->size = 0;
+    return tok;
+}
+
+static void
+fill_token(jsmntok_t *token, jsmntype_t type, int start, int end)
+{
+    token->type = type;
+    token->start = start;
+    token->end = end;
+    token->size = 0;
+}
+
+static int
+is_hex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') ||
+        (c >= 'a' && c <= 'f');
+}
+
+static int
+parse_primitive(jsmn_parser *parser, const char *js, size_t len,
+                jsmntok_t *tokens, unsigned num_tokens)
+{
+    jsmntok_t *token;
+    unsigned start = parser->pos, pos;
+
+    for (pos = start; pos < len && js[pos] != '\0'; pos++) {
+        switch (js[pos]) {
+        case ':':
+        case '\t': case '\r': case '\n': case ' ':
+        case ',': case ']': case '}':
+            goto found;
+        }
+        if (js[pos] < 32 || js[pos] >= 127)
+            return JSMN_ERROR_INVAL;
+    }
+
+found:
+    token = alloc_token(parser, tokens, num_tokens);
+    if (token == NULL)
+        return JSMN_ERROR_NOMEM;
+
+    fill_token(token, JSMN_PRIMITIVE, (int)start, (int)pos);
+    parser->pos = pos - 1;
+    return 0;
+}
+
+/* Unlike jsmn, an escape cut short by len is JSMN_ERROR_PART rather than a
+ * read past len. Both fail a complete body. Inlined into one function per
+ * scan, so that the scan is inlined as well. */
+static inline __attribute__((always_inline)) int
+parse_string(jsmn_parser *parser, const char *js, size_t len,
+             jsmntok_t *tokens, unsigned num_tokens, scan_f *scan)
+{
+    jsmntok_t *token;
+    unsigned start = parser->pos, n;
+    const char *p = js + start + 1, *e = js + len;
+
+    while ((p = scan(p, e)) < e && *p != '\0') {
+        if (*p == '"') {
+            token = alloc_token(parser, tokens, num_tokens);
+            if (token == NULL)
+                return JSMN_ERROR_NOMEM;
+            parser->pos = (unsigned)(p - js);
+            fill_token(token, JSMN_STRING, (int)start + 1, (int)parser->pos);
+            return 0;
+        }
+
+        /* Backslash, a quoted symbol is expected */
+        if (++p == e)
+            break;
+
+        switch (*p) {
+        case '"': case '/': case '\\': case 'b':
+        case 'f': case 'r': case 'n': case 't':
+            p++;
+            break;
+        case 'u':
+            /* Up to four hex digits, fewer when cut short */
+            for (p++, n = 0; n < 4 && p < e && *p != '\0'; n++, p++) {
+                if (!is_hex(*p))
+                    return JSMN_ERROR_INVAL;
+            }
+            break;
+        default:
+            return JSMN_ERROR_INVAL;
+        }
+    }
+
+    return JSMN_ERROR_PART;
+}
+
+/*--------------------------------------------------------------------
+ * Scans for the first quote, backslash or NUL in [p, e), or e
+ */
+
+static inline __attribute__((always_inline)) const char *
+scan_scalar(const char *p, const char *e)
+{
+    while (p < e && *p != '"' && *p != '\\' && *p != '\0')
+        p++;
+    return p;
+}
+
+static int
+string_scalar(jsmn_parser *parser, const char *js, size_t len,
+              jsmntok_t *tokens, unsigned num_tokens)
+{
+    return parse_string(parser, js, len, tokens, num_tokens, scan_scalar);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSCAN_X86
+
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) unsigned
+mask_sse2(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)(const void *)p);
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+        _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) const char *
+scan_sse2(const char *p, const char *e)
+{
+    unsigned mask;
+
+    for (; e - p >= 16; p += 16) {
+        if ((mask = mask_sse2(p)) != 0)
+            return p + __builtin_ctz(mask);
+    }
+
+    return scan_scalar(p, e);
+}
+
+/* Escapes are often only a few bytes apart, so one 16 byte step comes first */
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) const char *
+scan_avx2(const char *p, const char *e)
+{
+    unsigned mask;
+
+    if (e - p >= 16) {
+        if ((mask = mask_sse2(p)) != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+
+    for (; e - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+
+        if ((mask = (unsigned)_mm256_movemask_epi8(m)) != 0)
+            return p + __builtin_ctz(mask);
+    }
+
+    /* The remaining 31 bytes at most */
+    return scan_sse2(p, e);
+}
+
+__attribute__((target("sse2")))
+static int
+string_sse2(jsmn_parser *parser, const char *js, size_t len,
+            jsmntok_t *tokens, unsigned num_tokens)
+{
+    return parse_string(parser, js, len, tokens, num_tokens, scan_sse2);
+}
+
+__attribute__((target("avx2")))
+static int
+string_avx2(jsmn_parser *parser, const char *js, size_t len,
+            jsmntok_t *tokens, unsigned num_tokens)
+{
+    return parse_string(parser, js, len, tokens, num_tokens, scan_avx2);
+}
+#endif
+
+/*--------------------------------------------------------------------
+ * Runtime selection
+ */
+
+static const struct {
+    const char                  *name;
+    string_f                    *fn;
+} impls[] = {
+    [JSCAN_SCALAR] =    { "scalar",     string_scalar },
+#ifdef JSCAN_X86
+    [JSCAN_SSE2] =      { "sse2",       string_sse2 },
+    [JSCAN_AVX2] =      { "avx2",       string_avx2 },
+#endif
+};
+
+/* Chosen on first use. Racing threads all pick the same one. */
+static enum jscan_impl impl;
+
+static int
+supported(enum jscan_impl i)
+{
+    switch (i) {
+    case JSCAN_SCALAR:
+        return 1;
+#ifdef JSCAN_X86
+    case JSCAN_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case JSCAN_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+static enum jscan_impl
+best(void)
+{
+    if (supported(JSCAN_AVX2))
+        return JSCAN_AVX2;
+    if (supported(JSCAN_SSE2))
+        return JSCAN_SSE2;
+    return JSCAN_SCALAR;
+}
+
+static enum jscan_impl
+current(void)
+{
+    enum jscan_impl i = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+    if (i == JSCAN_AUTO) {
+        i = best();
+        __atomic_store_n(&impl, i, __ATOMIC_RELAXED);
+    }
+    return i;
+}
+
+/* Forces an implementation, for the benchmarks. Returns 0 when the CPU or
+ * the build does not support it. */
+int
+jscan_select(enum jscan_impl i)
+{
+    if (i == JSCAN_AUTO)
+        i = best();
+    else if (!supported(i))
+        return 0;
+
+    __atomic_store_n(&impl, i, __ATOMIC_RELAXED);
+    return 1;
+}
+
+const char *
+jscan_name(void)
+{
+    return impls[current()].name;
+}
+
+/*--------------------------------------------------------------------
+ * The main loop, the structure between the strings
+ */
+
+int
+jscan_parse(jsmn_parser *parser, const char *js, size_t len,
+            jsmntok_t *tokens, unsigned num_tokens)
+{
+    string_f *parse_str = impls[current()].fn;
+    jsmntok_t *token;
+    jsmntype_t type;
+    unsigned pos;
+    int count = 0, r, i;
+
+    AN(parser);
+    AN(js);
+    AN(tokens);
+
+    for (pos = parser->pos; pos < len && js[pos] != '\0'; pos++) {
+        char c = js[pos];
+
+        /* Indentation runs, kept out of the jump table */
+        if (c == ' ' || c == '\n')
+            continue;
+
+        switch (c) {
+        case '\t': case '\r': case ':': case ',':
+            break;
+        case '{': case '[':
+            count++;
+            token = alloc_token(parser, tokens, num_tokens);
+            if (token == NULL) {
+                parser->pos = pos;
+                return JSMN_ERROR_NOMEM;
+            }
+            if (parser->toksuper != -1)
+                tokens[parser->toksuper].size++;
+            token->type = (c == '{' ? JSMN_OBJECT : JSMN_ARRAY);
+            token->start = (int)pos;
+            parser->toksuper = (int)parser->toknext - 1;
+            break;
+        case '}': case ']':
+            type = (c == '}' ? JSMN_OBJECT : JSMN_ARRAY);
+            for (i = (int)parser->toknext - 1; i >= 0; i--) {
+                token = &tokens[i];
+                if (token->start != -1 && token->end == -1) {
+                    if (token->type != type) {
+                        parser->pos = pos;
+                        return JSMN_ERROR_INVAL;
+                    }
+                    parser->toksuper = -1;
+                    token->end = (int)pos + 1;
+                    break;
+                }
+            }
+            /* Error if unmatched closing bracket */
+            if (i == -1) {
+                parser->pos = pos;
+                return JSMN_ERROR_INVAL;
+            }
+            for (; i >= 0; i--) {
+                token = &tokens[i];
+                if (token->start != -1 && token->end == -1) {
+                    parser->toksuper = i;
+                    break;
+                }
+            }
+            break;
+        case '"':
+            parser->pos = pos;
+            r = parse_str(parser, js, len, tokens, num_tokens);
+            if (r < 0)
+                return r;
+            pos = parser->pos;
+            count++;
+            if (parser->toksuper != -1)
+                tokens[parser->toksuper].size++;
+            break;
+        default:
+            /* Every unquoted value is a primitive */
+            parser->pos = pos;
+            r = parse_primitive(parser, js, len, tokens, num_tokens);
+            if (r < 0)
+                return r;
+            pos = parser->pos;
+            count++;
+            if (parser->toksuper != -1)
+                tokens[parser->toksuper].size++;
+            break;
+        }
+    }
+    parser->pos = pos;
+
+    for (i = (int)parser->toknext - 1; i >= 0; i--) {
+        /* Unmatched opened object or array */
+        if (tokens[i].start != -1 && tokens[i].end == -1)
+            return JSMN_ERROR_PART;
+    }
+
+    return count;
+}
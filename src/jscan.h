@@ -0,0 +1,29 @@
+#ifndef JSCAN_H
+#define JSCAN_H
+
+#include <stddef.h>
+
+#include "jsmn.h"
+
+/* Implementations of the scan for the end of a json string, JSCAN_AUTO picks
+ * the fastest one the CPU supports */
+enum jscan_impl {
+    JSCAN_AUTO = 0,
+    JSCAN_SCALAR,
+    JSCAN_SSE2,
+    JSCAN_AVX2,
+};
+
+/* Same contract as jsmn_parse(), tokens included, and resumable the same way
+ * after JSMN_ERROR_PART or JSMN_ERROR_NOMEM. tokens must not be NULL. */
+int
+jscan_parse(jsmn_parser *parser, const char *js, size_t len,
+            jsmntok_t *tokens, unsigned num_tokens);
+
+int
+jscan_select(enum jscan_impl impl);
+
+const char *
+jscan_name(void);
+
+#endif
@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vsb.h"
+#include "vtim.h"
+
+#include "notify.h"
+
+/* Fire-and-forget events for the web script. Workers serialize an event and
+ * push it onto a bounded lock-free ring, one background thread pops them and
+ * POSTs them in batches, one event per line. A full ring drops new events, or
+ * with a max wait set, holds the worker up to that long for room. Workers only
+ * take the lock to wake the thread, and only while it is asleep. */
+
+struct notify_event {
+    unsigned magic;
+#define NOTIFY_EVENT_MAGIC 0x1F4C8D27
+    char                        *url;
+    char                        *sock;      /* Unix domain socket, or NULL */
+    long                        timeout;   /* ms */
+    size_t                      len;
+    char                        data[];
+};
+
+/* Bounded multi-producer queue after Dmitry Vyukov. A cell is free for the
+ * producer at position pos when its seq is pos, and holds an event for the
+ * consumer when its seq is pos + 1. */
+struct notify_cell {
+    uint64_t                    seq;
+    struct notify_event         *ev;
+};
+
+static struct notify_cell ring[NOTIFY_QUEUE];
+static uint64_t ring_head = 0;          /* Next push */
+static uint64_t ring_tail = 0;          /* Next pop, only the thread moves it */
+
+static pthread_mutex_t notify_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
+static unsigned notify_sleeping = 0;
+static unsigned notify_stop = 0;
+static pthread_t notify_thread;
+
+static unsigned batch_max = NOTIFY_BATCH;
+static double flush_interval = NOTIFY_INTERVAL;
+static double max_wait = 0;
+
+static struct notify_stats stats;
+
+static uint64_t
+ring_len(void)
+{
+    return __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+}
+
+static int
+ring_push(struct notify_event *ev)
+{
+    struct notify_cell *cell;
+    uint64_t pos, seq;
+
+    pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &ring[pos & (NOTIFY_QUEUE - 1)];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((int64_t)(seq - pos) < 0)
+            return 0;   /* Full */
+        else
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    }
+
+    cell->ev = ev;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static struct notify_event *
+ring_pop(void)
+{
+    struct notify_cell *cell;
+    struct notify_event *ev;
+    uint64_t pos = ring_tail;
+
+    cell = &ring[pos & (NOTIFY_QUEUE - 1)];
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return NULL;
+
+    ev = cell->ev;
+    cell->ev = NULL;
+    __atomic_store_n(&cell->seq, pos + NOTIFY_QUEUE, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring_tail, pos + 1, __ATOMIC_RELEASE);
+
+    CHECK_OBJ_NOTNULL(ev, NOTIFY_EVENT_MAGIC);
+    return ev;
+}
+
+static int
+same_target(const struct notify_event *a, const struct notify_event *b)
+{
+    if (strcmp(a->url, b->url) != 0)
+        return 0;
+    if (a->sock == NULL || b->sock == NULL)
+        return a->sock == b->sock;
+    return strcmp(a->sock, b->sock) == 0;
+}
+
+static size_t
+discard(void *ptr, size_t size, size_t nmemb, void *ud)
+{
+    (void)ptr;
+    (void)ud;
+    return size * nmemb;
+}
+
+/* POSTs the events to the target of the first one, and frees them */
+static void
+send_batch(CURL *ch, struct vsb *body, struct curl_slist *headers,
+           struct notify_event **batch, unsigned n)
+{
+    long status = 0;
+
+    AN(n);
+
+    VSB_clear(body);
+    for (unsigned i = 0; i < n; i++) {
+        VSB_bcat(body, batch[i]->data, batch[i]->len);
+        VSB_putc(body, '\n');
+    }
+    AZ(VSB_finish(body));
+
+    /* Clears all options but keeps the connection cache */
+    curl_easy_reset(ch);
+    curl_easy_setopt(ch, CURLOPT_URL, batch[0]->url);
+    if (batch[0]->sock)
+        curl_easy_setopt(ch, CURLOPT_UNIX_SOCKET_PATH, batch[0]->sock);
+    curl_easy_setopt(ch, CURLOPT_POSTFIELDS, VSB_data(body));
+    curl_easy_setopt(ch, CURLOPT_POSTFIELDSIZE, (long)VSB_len(body));
+    curl_easy_setopt(ch, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(ch, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(ch, CURLOPT_TIMEOUT_MS, batch[0]->timeout);
+    curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, discard);
+
+    CURLcode ret = curl_easy_perform(ch);
+    curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
+
+    if (ret == CURLE_OK && status >= 200 && status < 300) {
+        __sync_add_and_fetch(&stats.sent, n);
+        __sync_add_and_fetch(&stats.batches, 1);
+    }
+    else
+        __sync_add_and_fetch(&stats.failed, n);
+
+    for (unsigned i = 0; i < n; i++)
+        FREE_OBJ(batch[i]);
+}
+
+static void
+add_seconds(struct timespec *ts, const struct timespec *from, double sec)
+{
+    ts->tv_sec = from->tv_sec + (time_t)sec;
+    ts->tv_nsec = from->tv_nsec + (long)((sec - (time_t)sec) * 1e9);
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Sleeps until a batch is full or the flush interval passed. The settings
+ * are read on every wakeup, notify_config() wakes the thread to apply them.
+ * Returns 1 once notify_fini() asks the thread to exit. */
+static unsigned
+wait_events(void)
+{
+    struct timespec start, ts;
+    unsigned stop;
+
+    AZ(clock_gettime(CLOCK_REALTIME, &start));
+
+    AZ(pthread_mutex_lock(&notify_mtx));
+    __atomic_store_n(&notify_sleeping, 1, __ATOMIC_SEQ_CST);
+    while (!notify_stop && ring_len() < batch_max) {
+        add_seconds(&ts, &start, flush_interval);
+        if (pthread_cond_timedwait(&notify_cond, &notify_mtx, &ts) == ETIMEDOUT)
+            break;
+    }
+    __atomic_store_n(&notify_sleeping, 0, __ATOMIC_SEQ_CST);
+    stop = notify_stop;
+    AZ(pthread_mutex_unlock(&notify_mtx));
+
+    return stop;
+}
+
+static void *
+notify_loop(void *arg)
+{
+    struct notify_event *batch[NOTIFY_BATCH_MAX];
+    struct notify_event *ev;
+    unsigned n;
+
+    (void)arg;
+
+    CURL *ch = curl_easy_init();
+    AN(ch);
+    struct vsb *body = VSB_new_auto();
+    AN(body);
+    struct curl_slist *headers = curl_slist_append(NULL,
+        "Content-Type: " NOTIFY_TYPE);
+    AN(headers);
+
+    while (!wait_events()) {
+        n = 0;
+        while ((ev = ring_pop()) != NULL) {
+            if (n > 0 && (n >= batch_max || !same_target(batch[0], ev))) {
+                send_batch(ch, body, headers, batch, n);
+                n = 0;
+            }
+            batch[n++] = ev;
+        }
+        if (n > 0)
+            send_batch(ch, body, headers, batch, n);
+    }
+
+    /* Not sent, a POST to a slow target would hold up the VCL discard */
+    while ((ev = ring_pop()) != NULL) {
+        __sync_add_and_fetch(&stats.dropped, 1);
+        FREE_OBJ(ev);
+    }
+
+    curl_slist_free_all(headers);
+    VSB_delete(body);
+    curl_easy_cleanup(ch);
+
+    return NULL;
+}
+
+void
+notify_init(void)
+{
+    for (uint64_t i = 0; i < NOTIFY_QUEUE; i++)
+        ring[i].seq = i;
+    ring_head = ring_tail = 0;
+
+    notify_stop = 0;
+    AZ(pthread_create(&notify_thread, NULL, notify_loop, NULL));
+}
+
+/* Stops the thread, dropping the events still queued. No request is left to
+ * queue more. */
+void
+notify_fini(void)
+{
+    AZ(pthread_mutex_lock(&notify_mtx));
+    notify_stop = 1;
+    AZ(pthread_cond_signal(&notify_cond));
+    AZ(pthread_mutex_unlock(&notify_mtx));
+
+    AZ(pthread_join(notify_thread, NULL));
+}
+
+/* Settings are global, the last VCL to load wins */
+void
+notify_config(unsigned batch, double interval, double wait)
+{
+    AZ(pthread_mutex_lock(&notify_mtx));
+    if (batch > 0)
+        batch_max = batch < NOTIFY_BATCH_MAX ? batch : NOTIFY_BATCH_MAX;
+    if (interval > 0)
+        flush_interval = interval;
+    max_wait = wait > 0 ? wait : 0;
+    AZ(pthread_cond_signal(&notify_cond));
+    AZ(pthread_mutex_unlock(&notify_mtx));
+}
+
+/* Queues a copy of the event, returns 0 when it was dropped */
+int
+notify_submit(const char *url, const char *sock, long timeout,
+              const char *data, size_t len)
+{
+    struct notify_event *ev;
+    size_t ulen, slen;
+    double deadline = 0;
+
+    AN(url);
+    AN(data);
+
+    ulen = strlen(url) + 1;
+    slen = sock ? strlen(sock) + 1 : 0;
+
+    ev = malloc(sizeof *ev + len + ulen + slen);
+    AN(ev);
+    memset(ev, 0, sizeof *ev);
+    ev->magic = NOTIFY_EVENT_MAGIC;
+    ev->len = len;
+    ev->timeout = timeout;
+    memcpy(ev->data, data, len);
+    ev->url = ev->data + len;
+    memcpy(ev->url, url, ulen);
+    if (sock) {
+        ev->sock = ev->url + ulen;
+        memcpy(ev->sock, sock, slen);
+    }
+
+    while (!ring_push(ev)) {
+        double now = VTIM_mono();
+
+        if (deadline == 0)
+            deadline = now + max_wait;
+
+        if (now >= deadline) {
+            __sync_add_and_fetch(&stats.dropped, 1);
+            FREE_OBJ(ev);
+            return 0;
+        }
+
+        (void)usleep(1000);
+    }
+
+    __sync_add_and_fetch(&stats.queued, 1);
+
+    if (__atomic_load_n(&notify_sleeping, __ATOMIC_SEQ_CST) &&
+        ring_len() >= batch_max) {
+        AZ(pthread_mutex_lock(&notify_mtx));
+        AZ(pthread_cond_signal(&notify_cond));
+        AZ(pthread_mutex_unlock(&notify_mtx));
+    }
+
+    return 1;
+}
+
+void
+notify_stats(struct notify_stats *st)
+{
+    AN(st);
+
+    st->queued = __sync_add_and_fetch(&stats.queued, 0);
+    st->dropped = __sync_add_and_fetch(&stats.dropped, 0);
+    st->sent = __sync_add_and_fetch(&stats.sent, 0);
+    st->failed = __sync_add_and_fetch(&stats.failed, 0);
+    st->batches = __sync_add_and_fetch(&stats.batches, 0);
+}
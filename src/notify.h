@@ -0,0 +1,40 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define NOTIFY_QUEUE            8192    /* Queued events, a power of 2 */
+#define NOTIFY_BATCH            100     /* Default events per POST */
+#define NOTIFY_BATCH_MAX        1000
+#define NOTIFY_INTERVAL         1.0     /* Default seconds between POSTs */
+#define NOTIFY_EVENT_MAX        16384   /* Largest serialized event */
+#define NOTIFY_TIMEOUT          5000L   /* ms, unless the backend has one */
+
+#define NOTIFY_TYPE             "application/x-ndjson"
+
+struct notify_stats {
+    uint64_t                    queued;     /* Events accepted */
+    uint64_t                    dropped;    /* Events refused, queue full */
+    uint64_t                    sent;       /* Events delivered */
+    uint64_t                    failed;     /* Events lost to a failed POST */
+    uint64_t                    batches;    /* POSTs delivered */
+};
+
+void
+notify_init(void);
+
+void
+notify_fini(void);
+
+void
+notify_config(unsigned batch, double interval, double max_wait);
+
+int
+notify_submit(const char *url, const char *sock, long timeout,
+              const char *data, size_t len);
+
+void
+notify_stats(struct notify_stats *stats);
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "vdef.h"
+#include "vas.h"
+
+#include "pool.h"
+
+/* Idle easy handles are kept in lock striped stacks. A handle keeps its own
+ * connection cache across curl_easy_reset(), so handing it back to the pool
+ * keeps the keep-alive connections to the script backends open. Each worker
+ * thread sticks to one stripe so it tends to get back its own warm handle. */
+struct pool_stripe {
+    pthread_mutex_t             mtx;
+    CURL                        **handles;
+    unsigned                    len;
+    unsigned                    max;
+    struct pool_stats           stats;
+};
+
+static struct pool_stripe stripes[POOL_STRIPES];
+static unsigned stripe_next = 0;
+static __thread int stripe_idx = -1;
+
+static struct pool_stripe *
+get_stripe(void)
+{
+    if (stripe_idx < 0)
+        stripe_idx = (int)(__sync_fetch_and_add(&stripe_next, 1) % POOL_STRIPES);
+
+    return &stripes[stripe_idx];
+}
+
+void
+pool_init(unsigned max)
+{
+    unsigned smax = max / POOL_STRIPES;
+
+    if (smax == 0)
+        smax = 1;
+
+    for (int i = 0; i < POOL_STRIPES; i++) {
+        struct pool_stripe *s = &stripes[i];
+
+        AZ(pthread_mutex_init(&s->mtx, NULL));
+        s->handles = calloc(smax, sizeof *s->handles);
+        AN(s->handles);
+        s->len = 0;
+        s->max = smax;
+        memset(&s->stats, 0, sizeof s->stats);
+    }
+}
+
+CURL *
+pool_get(void)
+{
+    struct pool_stripe *s = get_stripe();
+    CURL *ch = NULL;
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    if (s->len > 0) {
+        ch = s->handles[--s->len];
+        s->stats.hits++;
+    }
+    else
+        s->stats.misses++;
+    AZ(pthread_mutex_unlock(&s->mtx));
+
+    if (ch == NULL)
+        ch = curl_easy_init();
+
+    return ch;
+}
+
+void
+pool_put(CURL *ch)
+{
+    struct pool_stripe *s = get_stripe();
+
+    AN(ch);
+
+    /* Clears all options but keeps the connection and dns caches */
+    curl_easy_reset(ch);
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    if (s->len < s->max) {
+        s->handles[s->len++] = ch;
+        ch = NULL;
+    }
+    else
+        s->stats.evictions++;
+    AZ(pthread_mutex_unlock(&s->mtx));
+
+    if (ch)
+        curl_easy_cleanup(ch);
+}
+
+void
+pool_stats(struct pool_stats *stats)
+{
+    AN(stats);
+    memset(stats, 0, sizeof *stats);
+
+    for (int i = 0; i < POOL_STRIPES; i++) {
+        struct pool_stripe *s = &stripes[i];
+
+        AZ(pthread_mutex_lock(&s->mtx));
+        stats->hits += s->stats.hits;
+        stats->misses += s->stats.misses;
+        stats->evictions += s->stats.evictions;
+        AZ(pthread_mutex_unlock(&s->mtx));
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <curl/curl.h>
+
+#define POOL_STRIPES            16
+
+struct pool_stats {
+    uint64_t                    hits;       /* Handle reused from pool */
+    uint64_t                    misses;     /* Handle had to be created */
+    uint64_t                    evictions;  /* Handle dropped, pool was full */
+};
+
+void
+pool_init(unsigned max);
+
+CURL *
+pool_get(void);
+
+void
+pool_put(CURL *ch);
+
+void
+pool_stats(struct pool_stats *stats);
+
+#endif
@@ -7,9 +7,23 @@
 #include <sys/errno.h>
 #include <curl/curl.h>
 
+#include "vtim.h"
+
 #include "proxy.h"
+#include "pool.h"
+#include "rcache.h"
+#include "async.h"
+#include "hdrset.h"
+#include "breaker.h"
+#include "stats.h"
+#include "flight.h"
+#include "notify.h"
+#include "shmring.h"
+#include "script.h"
 
 static short init = 1;
+static unsigned have_http2 = 0;
+static unsigned config_ids = 0;
 
 /* Implementation of the static method cache_http.c::http_IsHdr() */
 static int
@@ -114,9 +128,204 @@ collect_header(struct http *hp, const char *hdr, const char sep)
     WS_ReleaseP(hp->ws, b + 1);
 }
 
-/* Gets an available backend to curl to */
+/* Implementation of the static method cache_http.c::http_VSLH_del() */
+static void
+log_unset(const struct http *hp, unsigned u)
+{
+    if (hp->vsl == NULL)
+        return;
+
+    assert(u >= HTTP_HDR_FIRST);
+    VSLbt(hp->vsl, (enum VSL_tag_e)(hp->logtag + HTTP_HDR_UNSET -
+        HTTP_HDR_METHOD), hp->hd[u]);
+}
+
+/* A name replaced by the recv headers, and the last header that sets it */
+struct apply_slot {
+    uint32_t                    hash;
+    unsigned                    idx;        /* Index + 1, 0 when free */
+};
+
+/* The Cookie header all others are merged into */
+struct apply_cookie {
+    unsigned                    found;
+    unsigned                    full;       /* Merging stopped, no room */
+    unsigned                    f;          /* Its index in hp->hd */
+    char                        *start;     /* Merged header, or start == b */
+    char                        *b;
+    char                        *e;
+};
+
+/* Returns the slot of the name, or the free slot it would take with the hash
+ * already set */
+static struct apply_slot *
+apply_find(struct apply_slot *tbl, unsigned mask,
+           const struct proxy_header *hdrs, const char *name, unsigned len)
+{
+    uint32_t hash = hdrset_hash(name, len);
+    unsigned i = hash & mask;
+
+    while (tbl[i].idx) {
+        const char *u = hdrs[tbl[i].idx - 1].unset;
+
+        if (tbl[i].hash == hash && (unsigned)u[0] - 1 == len &&
+            strncasecmp(u + 1, name, len) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+
+    tbl[i].hash = hash;
+    return &tbl[i];
+}
+
+/* Appends the value of a Cookie header to the first one, as collect_header()
+ * does, copying the first one the first time. Returns 0 when the header must
+ * be kept as it is, being the first or no longer fitting. */
+static int
+apply_cookie(const struct http *hp, struct apply_cookie *ac, const txt *t)
+{
+    unsigned l = (unsigned)H_Cookie[0], x;
+
+    if (!ac->found || ac->full)
+        return 0;
+
+    if (ac->b == ac->start) {
+        x = Tlen(hp->hd[ac->f]);
+        if (ac->b + x >= ac->e) {
+            ac->full = 1;
+            return 0;
+        }
+        memcpy(ac->b, hp->hd[ac->f].b, x);
+        ac->b += x;
+    }
+
+    x = Tlen(*t) - l;
+    if (ac->b + 1 + x >= ac->e) {
+        ac->full = 1;
+        return 0;
+    }
+    *ac->b++ = ';';
+    memcpy(ac->b, t->b + l, x);
+    ac->b += x;
+    return 1;
+}
+
+/* Applies the recv headers of a call with one compacting pass over hp->hd,
+ * where one http_Unset() per header and collect_header() after them would
+ * each scan all of it. The names to replace go in a hash table at the end of
+ * a workspace reservation and the merged Cookie header is written at its
+ * start. Of several headers with the same name only the last is added, as
+ * each would have unset the one before. Returns 0, having changed nothing,
+ * when the table does not fit. */
+static int
+apply_headers(struct http *hp, const struct proxy_header *hdrs, unsigned len,
+              unsigned cookies)
+{
+    struct apply_cookie ac;
+    struct apply_slot *tbl, *slot;
+    unsigned n = 0, size = 8, u, v, i;
+    const char *c;
+
+    CHECK_OBJ_NOTNULL(hp, HTTP_MAGIC);
+
+    if (WS_Overflowed(hp->ws))
+        return 0;
+
+    for (i = 0; i < len; i++)
+        n += (hdrs[i].unset != NULL);
+    while (size < n * 2)
+        size <<= 1;
+
+    unsigned avail = WS_Reserve(hp->ws, 0);
+    if (avail < size * sizeof *tbl) {
+        WS_Release(hp->ws, 0);
+        return 0;
+    }
+
+    tbl = (struct apply_slot *)(void *)(hp->ws->f + avail - size * sizeof *tbl);
+    memset(tbl, 0, size * sizeof *tbl);
+
+    memset(&ac, 0, sizeof ac);
+    ac.start = ac.b = hp->ws->f;
+    ac.e = (char *)tbl;
+
+    for (i = 0; i < len; i++) {
+        if (hdrs[i].unset == NULL)
+            continue;
+        slot = apply_find(tbl, size - 1, hdrs, hdrs[i].unset + 1,
+            (unsigned)hdrs[i].unset[0] - 1);
+        slot->idx = i + 1;
+    }
+
+    for (v = u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
+        const txt *t = &hp->hd[u];
+
+        if (t->b == NULL)
+            continue;
+
+        if (n > 0 && (c = memchr(t->b, ':', Tlen(*t))) != NULL &&
+            c - t->b < 64 &&
+            apply_find(tbl, size - 1, hdrs, t->b, (unsigned)(c - t->b))->idx) {
+            log_unset(hp, u);
+            continue;
+        }
+
+        if (cookies && is_header(t, H_Cookie)) {
+            if (apply_cookie(hp, &ac, t))
+                continue;
+            if (!ac.found) {
+                ac.found = 1;
+                ac.f = v;
+            }
+        }
+
+        if (v != u) {
+            hp->hd[v] = hp->hd[u];
+            hp->hdf[v] = hp->hdf[u];
+        }
+        v++;
+    }
+    hp->nhd = (uint16_t)v;
+
+    for (i = 0; i < len; i++) {
+        const char *hdr = hdrs[i].hdr;
+
+        if (hdrs[i].unset && apply_find(tbl, size - 1, hdrs,
+            hdrs[i].unset + 1, (unsigned)hdrs[i].unset[0] - 1)->idx != i + 1)
+            continue;
+
+        if (cookies && hdrs[i].unset == NULL &&
+            strncasecmp(hdr, H_Cookie + 1, H_Cookie[0]) == 0) {
+            txt t;
+            t.b = hdr;
+            t.e = strchr(hdr, '\0');
+            if (apply_cookie(hp, &ac, &t))
+                continue;
+            if (!ac.found && hp->nhd < hp->shd) {
+                ac.found = 1;
+                ac.f = hp->nhd;
+            }
+        }
+
+        http_SetHeader(hp, hdr);
+    }
+
+    if (ac.b == ac.start) {
+        WS_Release(hp->ws, 0);
+        return 1;
+    }
+
+    *ac.b = '\0';
+    hp->hd[ac.f].b = ac.start;
+    hp->hd[ac.f].e = ac.b;
+    WS_ReleaseP(hp->ws, ac.b + 1);
+    return 1;
+}
+
+/* Gets an available backend to curl to, and the director it resolved to */
 static const struct backend *
-get_backend(VRT_CTX, struct worker *wrk, const struct director *dir)
+get_backend(VRT_CTX, struct worker *wrk, const struct director *dir,
+            const struct director **resolved)
 {
     const struct director *be = NULL;
     const struct backend *bp = NULL;
@@ -134,6 +343,8 @@ get_backend(VRT_CTX, struct worker *wrk, const struct director *dir)
 
     if (VALID_OBJ(be, DIRECTOR_MAGIC)) {
         CAST_OBJ_NOTNULL(bp, be->priv, BACKEND_MAGIC);
+        if (resolved)
+            *resolved = be;
         return bp;
     }
 
@@ -143,25 +354,148 @@ get_backend(VRT_CTX, struct worker *wrk, const struct director *dir)
 void
 proxy_init()
 {
-    if (init)
+    if (init) {
         curl_global_init(CURL_GLOBAL_ALL);
+        pool_init(PROXY_POOL_MAX);
+        rcache_init(RCACHE_MAX_BYTES);
+        flight_init();
+
+        const curl_version_info_data *v = curl_version_info(CURLVERSION_NOW);
+        have_http2 = (v->features & CURL_VERSION_HTTP2) != 0;
+    }
 
     init = 0;
+
+    /* Threads and thread keys, torn down by proxy_fini() */
+    stats_init();
+    async_init();
+    errlog_init();
+    notify_init();
 }
 
+/* Called when the last VCL importing the vmod is discarded, before the .so is
+ * unloaded. No request is left by then. */
 void
-clear_request(struct proxy_request *req)
+proxy_fini(void)
+{
+    notify_fini();
+    async_fini();
+    errlog_fini();
+    stats_fini();
+}
+
+/* Drops the response of an earlier call. Headers already applied stay valid,
+ * they point into a plan block and not into the vsb. */
+static void
+release_body(struct proxy_request *req)
+{
+    stream_fini(&req->stream);
+
+    if (req->json) {
+        VSB_delete(req->json);
+        req->json = NULL;
+    }
+
+    req->body = NULL;
+}
+
+/* Drops any transfer left running by proxy_start() */
+static void
+cancel_async(struct proxy_request *req)
 {
     CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
 
-    req->ctx = NULL;
-    memset(req->json_toks, 0, sizeof req->json_toks);
+    if (req->async) {
+        async_release(req->async);
+        req->async = NULL;
+    }
+
+    // Never leave a half-open probe hanging, count it as failed
+    if (req->breaker) {
+        breaker_report(req->breaker, 0, 0);
+        req->breaker = NULL;
+    }
+}
+
+/* Forgets the outcome of the last call, so that a call again starts with no
+ * headers or error left over from it */
+static void
+reset_call(struct proxy_request *req)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+
+    cancel_async(req);
+
+    release_body(req);
+
+    req->json_toks = NULL;
     req->json_toks_len = 0;
+    req->recv_hdrs = NULL;
+    req->recv_len = 0;
+    req->deliver_hdrs = NULL;
+    req->deliver_len = 0;
     req->collect_cookies = 0;
-    req->restarts = 0;
     req->error = NULL;
+    req->script_ttl = -1;
+    req->backend = NULL;
+}
+
+void
+clear_request(struct proxy_request *req)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+
+    reset_call(req);
+
+    req->ctx = NULL;
+    req->restarts = 0;
+    req->cache_key = NULL;
+    req->cache_ttl = 0;
+    req->flight_key = NULL;
+    req->flight_wait = 0;
+    req->budget = 0;
+}
+
+/* The header lists of a call, packed like a cached object and followed by
+ * the proxy_header arrays that point into it. They are on the heap as
+ * std.rollback() resets the workspace, and the request keeps the block for
+ * its next call, or its next request once released. */
+struct proxy_plan {
+    struct proxy_plan           *next;      /* Retired ones of the request */
+    size_t                      size;       /* Of data */
+    size_t                      len;        /* Packed, 0 when unused */
+    char                        data[];
+};
+
+/* Frees the retired plan blocks, and the kept one too when all is set */
+static void
+free_plans(struct proxy_request *req, unsigned all)
+{
+    struct proxy_plan *pl;
+
+    while ((pl = req->retired) != NULL) {
+        req->retired = pl->next;
+        free(pl);
+    }
+
+    if (all) {
+        free(req->plan);
+        req->plan = NULL;
+    }
+    else if (req->plan)
+        req->plan->len = 0;
 }
 
+/* Requests released by this thread, kept with their header and plan blocks
+ * for the next ones it creates. A worker has one top-level request at a
+ * time, the few more cover requests that end on another thread than they
+ * began. */
+static __thread struct proxy_request *free_reqs = NULL;
+static __thread unsigned free_len = 0;
+
+/* The request state is on the heap, as std.rollback() resets the workspace
+ * while PRIV_TOP still holds it. The body is parsed in the workspace, but the
+ * headers it compiles to are kept in a plan block, see keep_plan(). */
 struct proxy_request *
 proxy_create_request(VRT_CTX)
 {
@@ -170,14 +504,20 @@ proxy_create_request(VRT_CTX)
 
     PROXY_DEBUG(ctx, "proxy_create_request%s", "");
 
-    struct proxy_request *req;
-    ALLOC_OBJ(req, PROXY_REQUEST_MAGIC);
-    AN(req);
+    struct proxy_request *req = free_reqs;
 
-    clear_request(req);
+    if (req != NULL) {
+        CHECK_OBJ(req, PROXY_REQUEST_MAGIC);
+        free_reqs = req->next;
+        free_len--;
+        req->next = NULL;
+    }
+    else {
+        ALLOC_OBJ(req, PROXY_REQUEST_MAGIC);
+        AN(req);
+    }
 
-    req->json = VSB_new_auto();
-    CHECK_OBJ_NOTNULL(req->json, VSB_MAGIC);
+    clear_request(req);
 
     return req;
 }
@@ -192,9 +532,6 @@ proxy_restart_request(VRT_CTX, struct proxy_request *req)
     clear_request(req);
 
     req->restarts = ctx->req->restarts;
-
-    CHECK_OBJ_NOTNULL(req->json, VSB_MAGIC);
-    VSB_clear(req->json);
 }
 
 void
@@ -204,10 +541,18 @@ proxy_release_request(void *ptr)
     CAST_OBJ_NOTNULL(req, ptr, PROXY_REQUEST_MAGIC);
 
     clear_request(req);
+    req->config = NULL;
 
-    if (req->json)
-        VSB_delete(req->json);
+    if (free_len < PROXY_FREE_MAX) {
+        free_plans(req, 0);
+        req->next = free_reqs;
+        free_reqs = req;
+        free_len++;
+        return;
+    }
 
+    free_plans(req, 1);
+    free(req->hdr_block);
     FREE_OBJ(req);
 }
 
@@ -257,192 +602,835 @@ curl_debug(CURL *ch, curl_infotype type, char *data, size_t size, void *ud)
 #endif
 
 
+/* Whether the response Content-Type selects the compact format */
+static unsigned
+is_compact(const char *type)
+{
+    size_t len = sizeof(PROXY_TYPE_COMPACT) - 1;
+
+    if (type == NULL || strncasecmp(type, PROXY_TYPE_COMPACT, len) != 0)
+        return 0;
+
+    return (type[len] == '\0' || type[len] == ';' ||
+        isspace((unsigned char)type[len]));
+}
+
+/* Gets the decoded body, so the size limit holds however well a response
+ * compresses. Going over it fails the transfer with CURLE_WRITE_ERROR. */
 static size_t
 curl_recv(void *ptr, size_t size, size_t nmemb, void *ud)
 {
-    struct vsb *body = NULL;
-    CAST_OBJ_NOTNULL(body, ud, VSB_MAGIC);
+    struct stream *st;
+    CAST_OBJ_NOTNULL(st, ud, STREAM_MAGIC);
+
+    /* Error responses are still parsed, but once complete, so that a page
+     * that is not json reports the status rather than a parse error */
+    if (st->state == STREAM_NEW) {
+        char *type = NULL;
+        long status = 0;
+        curl_easy_getinfo(st->ch, CURLINFO_CONTENT_TYPE, &type);
+        curl_easy_getinfo(st->ch, CURLINFO_RESPONSE_CODE, &status);
+        stream_begin(st, status == 200 && !is_compact(type));
+    }
+
+    /* A short count makes curl abort with CURLE_WRITE_ERROR */
+    if (stream_feed(st, ptr, size * nmemb) == -1)
+        return 0;
 
-    VSB_bcat(body, ptr, size * nmemb);
     return (size * nmemb);
 }
 
-void
-proxy_curl(VRT_CTX, struct proxy_request *req, const struct director *dir,
-            const char *path)
+/* Picks up the cache ttl the web script may send in a response header */
+static size_t
+curl_header(char *ptr, size_t size, size_t nmemb, void *ud)
 {
-    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
-    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
-    CHECK_OBJ_NOTNULL(req->json, VSB_MAGIC);
-
-    PROXY_DEBUG(ctx, "proxy_curl%s", "");
-
-    AZ(req->ctx);
-    req->ctx = ctx;
+    double *script_ttl = ud;
+    AN(script_ttl);
+
+    size_t len = size * nmemb;
+    size_t hlen = sizeof(PROXY_HEADER_TTL) - 1;
+
+    if (len > hlen + 1 && ptr[hlen] == ':' &&
+        strncasecmp(ptr, PROXY_HEADER_TTL, hlen) == 0) {
+        char val[32];
+        size_t vlen = len - hlen - 1;
+
+        if (vlen >= sizeof val)
+            vlen = sizeof val - 1;
+        memcpy(val, ptr + hlen + 1, vlen);
+        val[vlen] = '\0';
+
+        char *end;
+        double ttl = strtod(val, &end);
+        if (end != val)
+            *script_ttl = ttl;
+    }
 
-    const struct backend *be = get_backend(ctx, ctx->req->wrk, dir);
-    CHECK_OBJ_ORNULL(be, BACKEND_MAGIC);
+    return len;
+}
 
-    if (be == NULL)
-        PROXY_REQ_ERROR_VOID(req, "no backends available%s", "");
+/* Cached objects hold the compiled header lists: a cached_plan, then a
+ * cached_header per header (recv first), then every string they point to.
+ * Offsets are used so the strings can be copied at once. */
+struct cached_plan {
+    unsigned                    recv_len;
+    unsigned                    deliver_len;
+    unsigned                    collect_cookies;
+    unsigned                    strings_len;
+};
+
+struct cached_header {
+    unsigned                    hdr;
+    unsigned                    unset;      /* CACHED_NONE if not set */
+};
+
+#define CACHED_NONE             (~0U)
+
+static struct proxy_header *
+unpack_headers(struct proxy_header *hdrs, const char **datap, unsigned len,
+               char *strings)
+{
+    struct cached_header ch;
 
-    // TODO: abstract out hostname retrieval
-    char *url = WS_Printf(ctx->ws, "http://%s%s%s",
-        be->ipv4_addr, (*path == '/' ? "" : "/"), path
-    );
+    if (len == 0)
+        return NULL;
 
-    long port = strtol(be->port, NULL, 0);
+    for (unsigned i = 0; i < len; i++) {
+        memcpy(&ch, *datap, sizeof ch);     /* Cache data is not aligned */
+        *datap += sizeof ch;
+        hdrs[i].hdr = strings + ch.hdr;
+        hdrs[i].unset = (ch.unset == CACHED_NONE) ? NULL : strings + ch.unset;
+    }
 
-    CURL *ch = curl_easy_init();
-    AN(ch);
+    return hdrs;
+}
 
-    curl_easy_setopt(ch, CURLOPT_HTTPGET, 1L);
-    curl_easy_setopt(ch, CURLOPT_URL, url);
-    curl_easy_setopt(ch, CURLOPT_PORT, port);
-    curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 1L);
-    curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, curl_recv);
-    curl_easy_setopt(ch, CURLOPT_WRITEDATA, req->json);
+static size_t
+header_strings_len(const struct proxy_header *hdrs, unsigned len)
+{
+    size_t size = 0;
 
-#ifdef DEBUG
-    curl_easy_setopt(ch, CURLOPT_VERBOSE, DEBUG);
-    curl_easy_setopt(ch, CURLOPT_DEBUGFUNCTION, curl_debug);
-    curl_easy_setopt(ch, CURLOPT_DEBUGDATA, ctx);
-#endif
+    for (unsigned i = 0; i < len; i++) {
+        size += strlen(hdrs[i].hdr) + 1;
+        if (hdrs[i].unset)
+            size += (size_t)hdrs[i].unset[0] + 2;
+    }
 
-    if ((long)be->connect_timeout > 0)
-        curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT, (long)be->connect_timeout);
+    return size;
+}
 
-    if ((long)be->first_byte_timeout > 0)
-        curl_easy_setopt(ch, CURLOPT_TIMEOUT, (long)be->first_byte_timeout);
+static void
+pack_headers(char **datap, char *strings, size_t *off,
+             const struct proxy_header *hdrs, unsigned len)
+{
+    struct cached_header ch;
+    size_t l;
+
+    for (unsigned i = 0; i < len; i++) {
+        l = strlen(hdrs[i].hdr) + 1;
+        memcpy(strings + *off, hdrs[i].hdr, l);
+        ch.hdr = (unsigned)*off;
+        *off += l;
+
+        ch.unset = CACHED_NONE;
+        if (hdrs[i].unset) {
+            l = (size_t)hdrs[i].unset[0] + 2;
+            memcpy(strings + *off, hdrs[i].unset, l);
+            ch.unset = (unsigned)*off;
+            *off += l;
+        }
 
-    struct curl_slist *headers = NULL;
-    char *wshdr = NULL;
+        memcpy(*datap, &ch, sizeof ch);
+        *datap += sizeof ch;
+    }
+}
 
-    for (int u = 0; u < ctx->http_req->nhd; u++) {
-        const txt hdr = ctx->http_req->hd[u];
+/* Packs the compiled header lists into data, which is cp->strings_len plus
+ * the fixed part long */
+static void
+pack_plan(const struct proxy_request *req, const struct cached_plan *cp,
+          char *data)
+{
+    size_t hdrs_size = (cp->recv_len + cp->deliver_len) *
+        sizeof(struct cached_header);
+    char *p = data + sizeof *cp;
+    char *strings = p + hdrs_size;
+    size_t off = 0;
+
+    memcpy(data, cp, sizeof *cp);
+    pack_headers(&p, strings, &off, req->recv_hdrs, req->recv_len);
+    pack_headers(&p, strings, &off, req->deliver_hdrs, req->deliver_len);
+    assert(p == strings);
+    assert(off == cp->strings_len);
+}
 
-        if (u == HTTP_HDR_METHOD) { /* GET, PUT, etc */
-            wshdr = WS_Printf(ctx->ws, "X-Forwarded-Method: %s", hdr.b);
-            headers = curl_slist_append(headers, wshdr);
-        }
-        else if (u == HTTP_HDR_URL) { /* /foo */
-            wshdr = WS_Printf(ctx->ws, "X-Forwarded-Url: %s", hdr.b);
-            headers = curl_slist_append(headers, wshdr);
-        }
-        else if (u == HTTP_HDR_PROTO) { /* HTTP/1.1 */
-            wshdr = WS_Printf(ctx->ws, "Via: %s VMOD-HeaderProxy", hdr.b);
-            headers = curl_slist_append(headers, wshdr);
-        }
-        else if (u >= HTTP_HDR_FIRST) {
-            if (is_header(&hdr, H_Via) || is_header(&hdr, H_Content_Length)) {
-                continue;
-            }
-            else if (is_header(&hdr, H_Accept_Encoding)) {
-                //curl_easy_setopt(ch, CURLOPT_ENCODING, "gzip");
-                headers = curl_slist_append(headers, "Accept-Encoding: identity");
-            }
-            else
-                headers = curl_slist_append(headers, hdr.b);
-        }
+/* Returns a plan block of at least size bytes. One that headers applied
+ * earlier in the request may point to is retired rather than reused. */
+static struct proxy_plan *
+get_plan(struct proxy_request *req, size_t size)
+{
+    struct proxy_plan *pl = req->plan;
 
-        // TODO: Get CURLOPT_ENCODING to decode response. Currently broke
+    if (pl != NULL && pl->len > 0) {
+        pl->next = req->retired;
+        req->retired = pl;
+        pl = NULL;
     }
 
-    if (headers)
-        curl_easy_setopt(ch, CURLOPT_HTTPHEADER, headers);
+    if (pl == NULL || pl->size < size) {
+        pl = realloc(pl, sizeof *pl + size);
+        AN(pl);
+        pl->next = NULL;
+        pl->size = size;
+    }
 
-    PROXY_DEBUG(ctx, "curl url:%s", be->ipv4_addr);
-    CURLcode ret = curl_easy_perform(ch);
+    req->plan = pl;
+    return pl;
+}
 
-    long status;
-    curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
+/* Moves the header lists of the call into a plan block: the ones compiled in
+ * the workspace when data is NULL, else the packed plan data of len bytes
+ * from the cache or a flight leader */
+static void
+keep_plan(struct proxy_request *req, const char *data, size_t len)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
 
-    if (headers)
-        curl_slist_free_all(headers);
+    struct cached_plan cp;
 
-    curl_easy_cleanup(ch);
+    if (data == NULL) {
+        cp.recv_len = req->recv_len;
+        cp.deliver_len = req->deliver_len;
+        cp.collect_cookies = req->collect_cookies;
+        cp.strings_len = (unsigned)(
+            header_strings_len(req->recv_hdrs, req->recv_len) +
+            header_strings_len(req->deliver_hdrs, req->deliver_len));
+    }
+    else {
+        assert(len >= sizeof cp);
+        memcpy(&cp, data, sizeof cp);
+    }
 
-    if (ret != 0)
-        PROXY_REQ_ERROR_VOID(req, "curl err: %s", curl_easy_strerror(ret));
+    size_t hdrs_size = (cp.recv_len + cp.deliver_len) *
+        sizeof(struct cached_header);
+    size_t plen = sizeof cp + hdrs_size + cp.strings_len;
+    size_t off = PRNDUP(plen);
 
-    // Non 200 responses should report error, but still attempt to process json
-    if (status != 200) {
-        req->error = WS_Printf(ctx->ws, "curl err: %lu response", status);
-        PROXY_WARN(ctx, "curl err: %lu response", status);
-    }
+    assert(data == NULL || len == plen);
 
-    // TODO: check header content type
+    struct proxy_plan *pl = get_plan(req, off +
+        (cp.recv_len + cp.deliver_len) * sizeof(struct proxy_header));
 
-    VSB_finish(req->json);
-    char *json = VSB_data(req->json);
-    size_t json_len = strlen(json);
+    if (data == NULL)
+        pack_plan(req, &cp, pl->data);
+    else
+        memcpy(pl->data, data, len);
+    pl->len = plen;
+
+    struct proxy_header *hdrs = (struct proxy_header *)(void *)(pl->data + off);
+    char *strings = pl->data + sizeof cp + hdrs_size;
+    const char *p = pl->data + sizeof cp;
+
+    req->recv_hdrs = unpack_headers(hdrs, &p, cp.recv_len, strings);
+    req->deliver_hdrs = unpack_headers(hdrs + cp.recv_len, &p,
+        cp.deliver_len, strings);
+    req->recv_len = cp.recv_len;
+    req->deliver_len = cp.deliver_len;
+    req->collect_cookies = (uint8_t)cp.collect_cookies;
+}
 
-    if (json_len == 0)
-        PROXY_REQ_ERROR_VOID(req, "parse: no body%s", "");
+/* The key given in VCL only stands for the inputs of the script, so the
+ * VCL, backend and path of the call are added to it. A key reused for
+ * another script then misses rather than getting its headers. */
+static int
+scope_cache_key(struct proxy_request *req, const struct director *dir,
+                const char *path)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+    CHECK_OBJ_NOTNULL(req->ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_ORNULL(dir, DIRECTOR_MAGIC);
+    AN(req->cache_key);
 
-    if (json_len > 0x1FFFF)
-        PROXY_REQ_ERROR_VOID(req, "parse: body too big (%zu)", json_len);
+    if (path == NULL)
+        path = "";
 
-    /* Save expensive json parse if doesnt open and close with {} or []  */
-    char *p, fc = '\0', lc = '\0';
-    for (p = json; p < (json + json_len); p++) {
-        if (!isspace(*p)) {
-            if (!fc)
-                fc = *p;
-            lc = *p;
-        }
-    }
+    /* Backend names cannot hold a ':', the path is told from the key by
+     * its length */
+    req->cache_key = WS_Printf(req->ctx->ws, "%u:%s:%zu:%s:%s",
+        req->config ? req->config->id : 0, dir ? dir->vcl_name : "",
+        strlen(path), path, req->cache_key);
+    if (req->cache_key == NULL)
+        PROXY_REQ_ERROR_INT(req, "cache: out of workspace%s", "");
 
-    if ((fc != '{' && fc != '[') || (lc != '}' && lc != ']'))
-        PROXY_REQ_ERROR_VOID(req, "parse: bad delimiters%s", "");
+    return 0;
+}
 
-    jsmn_parser parser;
-    jsmn_init(&parser);
+static int
+cache_fetch(struct proxy_request *req)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+    AN(req->cache_key);
 
-    req->json_toks_len = jsmn_parse(
-        &parser, json, json_len, req->json_toks, JSON_MAX_TOKENS
-    );
+    struct rcache_obj *obj = rcache_lookup(req->cache_key);
+    if (obj == NULL)
+        return 0;
 
-    if (req->json_toks_len < 0)
-        PROXY_REQ_ERROR_VOID(req, "parse: failed to parse json%s", "");
+    size_t len;
+    const char *data = rcache_data(obj, &len);
+    keep_plan(req, data, len);
 
-    req->ctx = NULL;
+    rcache_deref(obj);
 
-    // int l;
-    // char t[255];
-    // for (int a = 0; a < request_toks_len; a++) {
-    //     l = req->json_toks[a].end - req->json_toks[a].start;
-    //     memcpy(t, json + req->json_toks[a].start, (l < 255 ? l : 255));
-    //     t[l] = '\0';
-    //     PROXY_DEBUG(ctx, "parse_response idx=%i size:%i type=%i val:%s",
-    //         a, req->json_toks[a].size, req->json_toks[a].type, t);
-    // }
+    return 1;
 }
 
-static short
-process_json(struct proxy_request *req, unsigned short *idx,
-             unsigned *type, unsigned short lvl)
+static void
+cache_store(struct proxy_request *req)
 {
     CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
     CHECK_OBJ_NOTNULL(req->ctx, VRT_CTX_MAGIC);
-    CHECK_OBJ_NOTNULL(req->json, VSB_MAGIC);
-    assert(req->json_toks_len > 0);
-    assert(*idx < req->json_toks_len);
+    AN(req->cache_key);
+    AN(req->plan);
 
-    char *json = VSB_data(req->json);
+    double ttl = req->script_ttl >= 0 ? req->script_ttl : req->cache_ttl;
+    if (ttl <= 0)
+        return;
 
-    const struct vrt_ctx *ctx = req->ctx;
-    jsmntok_t tok = req->json_toks[*idx];
+    rcache_insert(req->cache_key, req->plan->data, req->plan->len, ttl);
 
-    if (lvl == 0) { /* {lvl0} */
-        if (req->json_toks_len > 1 && tok.type != JSMN_OBJECT)
-            PROXY_REQ_ERROR_INT(req, "json error: root not object %i", req->json_toks_len);
-    }
-    else if (lvl == 1) { /* {'recv':[lvl1]} */
-        if (*type && tok.type != JSMN_ARRAY)
-            PROXY_REQ_ERROR_INT(req, "json error: lvl 1 not array%s", "");
-    }
+    PROXY_DEBUG(req->ctx, "cache store key:%s ttl:%.3f", req->cache_key, ttl);
+}
+
+/* Decides whether a client header is forwarded to the web script */
+static int
+forward_header(const struct proxy_config *cfg, const txt *hdr)
+{
+    CHECK_OBJ_ORNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    if (cfg == NULL || cfg->fwd_mode == PROXY_FWD_ALL)
+        return 1;
+
+    const char *c = memchr(hdr->b, ':', Tlen(*hdr));
+    size_t len = c ? (size_t)(c - hdr->b) : Tlen(*hdr);
+    int match = hdrset_match(cfg->fwd_headers, hdr->b, len);
+
+    return (cfg->fwd_mode == PROXY_FWD_ALLOW ? match : !match);
+}
+
+/* Builds the forwarded request headers as a curl_slist held in a single
+ * allocation, so it must be released with free() rather than
+ * curl_slist_free_all(). Lines are collected as prefix + text + suffix first
+ * to size the allocation. Sync calls are done with the list before the
+ * request is, so theirs is the block kept by the request. */
+struct fwd_line {
+    const char                  *pfx;
+    const char                  *b;
+    const char                  *e;
+    const char                  *sfx;
+};
+
+static struct curl_slist *
+build_headers(VRT_CTX, struct proxy_request *req, unsigned own)
+{
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+
+    const struct http *hp = ctx->http_req;
+    struct fwd_line *lines, *l;
+    unsigned n = 0;
+    size_t size = 0;
+
+    lines = WS_Alloc(ctx->ws, hp->nhd * sizeof *lines);
+    if (lines == NULL)
+        return NULL;
+
+    for (unsigned u = 0; u < hp->nhd; u++) {
+        const txt hdr = hp->hd[u];
+
+        l = &lines[n];
+        l->pfx = "";
+        l->b = hdr.b;
+        l->e = hdr.e;
+        l->sfx = "";
+
+        if (u == HTTP_HDR_METHOD) /* GET, PUT, etc */
+            l->pfx = "X-Forwarded-Method: ";
+        else if (u == HTTP_HDR_URL) /* /foo */
+            l->pfx = "X-Forwarded-Url: ";
+        else if (u == HTTP_HDR_PROTO) { /* HTTP/1.1 */
+            l->pfx = "Via: ";
+            l->sfx = " VMOD-HeaderProxy";
+        }
+        else if (u >= HTTP_HDR_FIRST) {
+            // curl sends the encodings it can decode, see curl_prepare()
+            if (is_header(&hdr, H_Via) || is_header(&hdr, H_Content_Length) ||
+                is_header(&hdr, H_Accept_Encoding))
+                continue;
+            else if (!forward_header(req->config, &hdr))
+                continue;
+        }
+        else
+            continue;
+
+        size += sizeof(struct curl_slist) + strlen(l->pfx) +
+            (size_t)(l->e - l->b) + strlen(l->sfx) + 1;
+        n++;
+    }
+
+    if (n == 0)
+        return NULL;
+
+    char *block;
+
+    if (own) {
+        if (req->hdr_size < size) {
+            req->hdr_block = realloc(req->hdr_block, size);
+            AN(req->hdr_block);
+            req->hdr_size = size;
+        }
+        block = req->hdr_block;
+    }
+    else {
+        block = malloc(size);
+        AN(block);
+    }
+
+    struct curl_slist *nodes = (struct curl_slist *)block;
+    char *p = block + n * sizeof *nodes;
+
+    for (unsigned i = 0; i < n; i++) {
+        size_t len;
+
+        l = &lines[i];
+        nodes[i].data = p;
+        nodes[i].next = (i + 1 < n) ? &nodes[i + 1] : NULL;
+
+        len = strlen(l->pfx);
+        memcpy(p, l->pfx, len);
+        p += len;
+        len = (size_t)(l->e - l->b);
+        if (len)
+            memcpy(p, l->b, len);
+        p += len;
+        len = strlen(l->sfx);
+        memcpy(p, l->sfx, len);
+        p += len;
+        *p++ = '\0';
+    }
+
+    assert(p == block + size);
+    return nodes;
+}
+
+/* Curl timeouts are set in milliseconds, so a 0.2s backend timeout does not
+ * truncate to 0 (no timeout). Anything under 1ms rounds up to 1ms. */
+static long
+timeout_ms(double seconds)
+{
+    long ms = (long)(seconds * 1e3);
+
+    return ms < 1 ? 1 : ms;
+}
+
+/* Returns the unix domain socket configured for a backend, or NULL */
+static const char *
+get_socket(const struct proxy_config *cfg, const struct director *dir)
+{
+    const struct proxy_socket *ps;
+
+    if (cfg == NULL || dir == NULL)
+        return NULL;
+
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    VTAILQ_FOREACH(ps, &cfg->sockets, list) {
+        CHECK_OBJ_NOTNULL(ps, PROXY_SOCKET_MAGIC);
+        if (ps->dir == dir)
+            return ps->path;
+    }
+
+    return NULL;
+}
+
+/* Returns the sidecar ring configured for a backend, or NULL */
+static struct shmring *
+get_sidecar(const struct proxy_config *cfg, const struct director *dir)
+{
+    const struct proxy_sidecar *sc;
+
+    if (cfg == NULL || dir == NULL)
+        return NULL;
+
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    VTAILQ_FOREACH(sc, &cfg->sidecars, list) {
+        CHECK_OBJ_NOTNULL(sc, PROXY_SIDECAR_MAGIC);
+        if (sc->dir == dir)
+            return sc->ring;
+    }
+
+    return NULL;
+}
+
+/* Returns the Lua script configured for a backend, or NULL */
+static const struct proxy_script *
+get_script(const struct proxy_config *cfg, const struct director *dir)
+{
+    const struct proxy_script *ps;
+
+    if (cfg == NULL || dir == NULL)
+        return NULL;
+
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    VTAILQ_FOREACH(ps, &cfg->scripts, list) {
+        CHECK_OBJ_NOTNULL(ps, PROXY_SCRIPT_MAGIC);
+        if (ps->dir == dir)
+            return ps;
+    }
+
+    return NULL;
+}
+
+/* Builds the url to call on a backend. Over a unix domain socket the host
+ * part is only a placeholder, the forwarded Host header replaces it. */
+static char *
+get_url(VRT_CTX, const struct backend *be, const char *sock, const char *path)
+{
+    const char *sep = (*path == '/' ? "" : "/");
+
+    CHECK_OBJ_NOTNULL(be, BACKEND_MAGIC);
+
+    if (sock)
+        return WS_Printf(ctx->ws, "http://localhost%s%s", sep, path);
+    else if (be->ipv4_addr)
+        return WS_Printf(ctx->ws, "http://%s%s%s", be->ipv4_addr, sep, path);
+
+    AN(be->ipv6_addr);
+    return WS_Printf(ctx->ws, "http://[%s]%s%s", be->ipv6_addr, sep, path);
+}
+
+/* What is left of the budget, which counts from the start of the client
+ * request. Only meaningful when the call has a budget. */
+static double
+budget_left(VRT_CTX, const struct proxy_request *req)
+{
+    return req->budget - (VTIM_real() - ctx->req->t_req);
+}
+
+/* Bounds a call to the backend timeouts, and to what is left of the budget.
+ * Returns 0 when less than PROXY_BUDGET_MIN is left and the call is not worth
+ * making. */
+static int
+call_timeouts(VRT_CTX, const struct proxy_request *req,
+              const struct backend *be, double *connect, double *total)
+{
+    *connect = be->connect_timeout;
+    *total = be->first_byte_timeout;
+
+    if (req->budget <= 0)
+        return 1;
+
+    double left = budget_left(ctx, req);
+
+    if (left < PROXY_BUDGET_MIN)
+        return 0;
+
+    if (*connect <= 0 || *connect > left)
+        *connect = left;
+    if (*total <= 0 || *total > left)
+        *total = left;
+
+    return 1;
+}
+
+/* Sets up a pooled curl handle to call a resolved backend. Sync calls write
+ * the response straight into the request, async ones into the job. */
+static CURL *
+curl_handle(VRT_CTX, struct proxy_request *req, const struct backend *be,
+            const struct director *rdir, const char *path,
+            struct async_job *job, double connect, double total,
+            struct curl_slist **headersp)
+{
+    unsigned http2 = (req->config && req->config->http2);
+    const char *sock = get_socket(req->config, rdir);
+    char *url = get_url(ctx, be, sock, path);
+
+    long port = strtol(be->port, NULL, 0);
+
+    CURL *ch = pool_get();
+    AN(ch);
+
+    if (sock)
+        curl_easy_setopt(ch, CURLOPT_UNIX_SOCKET_PATH, sock);
+
+    curl_easy_setopt(ch, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(ch, CURLOPT_URL, url);
+    curl_easy_setopt(ch, CURLOPT_PORT, port);
+    curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(ch, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, curl_recv);
+    /* Offers and decodes every encoding libcurl was built with */
+    curl_easy_setopt(ch, CURLOPT_ACCEPT_ENCODING, "");
+    if (job) {  /* Sync calls set this in curl_sync() */
+        stream_init(&job->stream, job->body, ch, PROXY_BODY_MAX,
+            req->config ? req->config->max_tokens : JSON_MAX_TOKENS, 0);
+        curl_easy_setopt(ch, CURLOPT_WRITEDATA, &job->stream);
+    }
+
+    /* Streams to the same backend share a connection of the multi handle,
+     * PIPEWAIT makes curl wait for it rather than open another one */
+    if (http2) {
+        curl_easy_setopt(ch, CURLOPT_HTTP_VERSION,
+            CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+        curl_easy_setopt(ch, CURLOPT_PIPEWAIT, 1L);
+    }
+
+    if (req->cache_key) {
+        curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, curl_header);
+        curl_easy_setopt(ch, CURLOPT_HEADERDATA,
+            job ? &job->script_ttl : &req->script_ttl);
+    }
+
+#ifdef DEBUG
+    /* The vsl of ctx can only be written from the worker thread */
+    if (job == NULL) {
+        curl_easy_setopt(ch, CURLOPT_VERBOSE, DEBUG);
+        curl_easy_setopt(ch, CURLOPT_DEBUGFUNCTION, curl_debug);
+        curl_easy_setopt(ch, CURLOPT_DEBUGDATA, ctx);
+    }
+#endif
+
+    if (connect > 0)
+        curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT_MS, timeout_ms(connect));
+
+    if (total > 0)
+        curl_easy_setopt(ch, CURLOPT_TIMEOUT_MS, timeout_ms(total));
+
+    struct curl_slist *headers = build_headers(ctx, req, job == NULL);
+
+    if (headers)
+        curl_easy_setopt(ch, CURLOPT_HTTPHEADER, headers);
+
+    PROXY_DEBUG(ctx, "curl url:%s socket:%s", url, sock ? sock : "-");
+
+    *headersp = headers;
+    return ch;
+}
+
+/* Resolves the backend for the proxy call and sets up a curl handle for it.
+ * Returns NULL with req->error set when the call cannot be made. */
+static CURL *
+curl_prepare(VRT_CTX, struct proxy_request *req, const struct director *dir,
+             const char *path, struct async_job *job,
+             struct curl_slist **headersp)
+{
+    double connect, total;
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+    CHECK_OBJ_ORNULL(job, ASYNC_JOB_MAGIC);
+    AN(headersp);
+
+    const struct director *rdir = NULL;
+    const struct backend *be = get_backend(ctx, ctx->req->wrk, dir, &rdir);
+    CHECK_OBJ_ORNULL(be, BACKEND_MAGIC);
+
+    if (be == NULL)
+        PROXY_REQ_ERROR_NULL(req, "no backends available%s", "");
+
+    if (!call_timeouts(ctx, req, be, &connect, &total))
+        PROXY_REQ_ERROR_NULL(req, "budget: exhausted%s", "");
+
+    if (req->config && req->config->http2 && !have_http2)
+        PROXY_REQ_ERROR_NULL(req, "http2: not supported by libcurl%s", "");
+
+    if (req->config && req->config->breakers) {
+        CHECK_OBJ_NOTNULL(rdir, DIRECTOR_MAGIC);
+
+        if (rdir->healthy && !rdir->healthy(rdir, NULL, NULL))
+            PROXY_REQ_ERROR_NULL(req, "breaker: backend unhealthy%s", "");
+
+        struct breaker *b = breaker_get(req->config->breakers, be);
+        if (!breaker_allow(b))
+            PROXY_REQ_ERROR_NULL(req, "breaker: open%s", "");
+        req->breaker = b;
+    }
+
+    req->backend = be;
+    return curl_handle(ctx, req, be, rdir, path, job, connect, total,
+        headersp);
+}
+
+/* Reads the 4 hex digits of a \uXXXX escape */
+static int
+hex4(const char *s, unsigned *v)
+{
+    *v = 0;
+
+    for (int i = 0; i < 4; i++) {
+        *v <<= 4;
+        if (s[i] >= '0' && s[i] <= '9')
+            *v |= (unsigned)(s[i] - '0');
+        else if (s[i] >= 'a' && s[i] <= 'f')
+            *v |= (unsigned)(s[i] - 'a' + 10);
+        else if (s[i] >= 'A' && s[i] <= 'F')
+            *v |= (unsigned)(s[i] - 'A' + 10);
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Copies the json string s of len bytes to dst, resolving json escapes.
+ * Escapes of control characters other than tab cannot go in a header and are
+ * kept as written, and lone surrogates become U+FFFD. The result is never
+ * longer than s, so dst may be s itself. Returns the end of the copy, or NULL
+ * for a malformed escape. */
+static char *
+unescape(char *dst, const char *s, size_t len)
+{
+    const char *sp, *esc, *end = s + len;
+    unsigned cp, lo;
+
+    for (sp = s; sp < end; sp++) {
+        if (*sp != '\\') {
+            *dst++ = *sp;
+            continue;
+        }
+
+        esc = sp;
+        if (++sp == end)
+            return NULL;
+
+        switch (*sp) {
+            case '"': case '/': case '\\':
+                *dst++ = *sp;
+                continue;
+            case 't':
+                *dst++ = '\t';
+                continue;
+            case 'b': case 'f': case 'n': case 'r':
+                *dst++ = '\\';
+                *dst++ = *sp;
+                continue;
+            case 'u':
+                break;
+            default:
+                return NULL;
+        }
+
+        if (end - sp < 5 || hex4(sp + 1, &cp) != 0)
+            return NULL;
+        sp += 4;
+
+        if (cp >= 0xD800 && cp <= 0xDBFF && end - sp >= 7 && sp[1] == '\\' &&
+            sp[2] == 'u' && hex4(sp + 3, &lo) == 0 &&
+            lo >= 0xDC00 && lo <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            sp += 6;
+        }
+        else if (cp >= 0xD800 && cp <= 0xDFFF)
+            cp = 0xFFFD;
+
+        if ((cp < 0x20 && cp != '\t') || cp == 0x7F) {
+            memmove(dst, esc, 6);
+            dst += 6;
+        }
+        else if (cp < 0x80)
+            *dst++ = (char)cp;
+        else if (cp < 0x800) {
+            *dst++ = (char)(0xC0 | (cp >> 6));
+            *dst++ = (char)(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000) {
+            *dst++ = (char)(0xE0 | (cp >> 12));
+            *dst++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *dst++ = (char)(0x80 | (cp & 0x3F));
+        }
+        else {
+            *dst++ = (char)(0xF0 | (cp >> 18));
+            *dst++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+            *dst++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+            *dst++ = (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    return dst;
+}
+
+/* Adds a "name: value" string that already lives in the workspace to the
+ * header list of the vcl method */
+static int
+add_header(struct proxy_request *req, unsigned type, const char *hdr,
+           size_t len)
+{
+    const struct vrt_ctx *ctx = req->ctx;
+    struct proxy_header *ph;
+
+    if (type == VCL_MET_RECV)
+        ph = &req->recv_hdrs[req->recv_len];
+    else {
+        assert(type == VCL_MET_DELIVER);
+        ph = &req->deliver_hdrs[req->deliver_len];
+    }
+
+    ph->hdr = hdr;
+    ph->unset = NULL;
+
+    if (type == VCL_MET_DELIVER) {
+        req->deliver_len++;
+        return 0;
+    }
+
+    // Request headers replace existing ones, except cookies
+    const char *cp = memchr(hdr, ':', len);
+    AN(cp);
+
+    if (strncasecmp(hdr, H_Cookie + 1, H_Cookie[0]) == 0)
+        req->collect_cookies = 1;
+    else if ((cp - hdr) < 64) {
+        char *nhdr = WS_Alloc(ctx->ws, (unsigned)(cp - hdr) + 3);
+        if (nhdr == NULL)
+            PROXY_REQ_ERROR_INT(req, "parse: out of workspace%s", "");
+        nhdr[0] = (char)(cp - hdr + 1);
+        memcpy(nhdr + 1, hdr, (size_t)(cp - hdr + 1));
+        nhdr[cp - hdr + 2] = '\0';
+        ph->unset = nhdr;
+    }
+
+    req->recv_len++;
+    return 0;
+}
+
+/* Walks the json token tree once, right after parsing, and compiles the
+ * headers of each vcl method into a list that proxy_process_request() only
+ * has to apply. Header strings are terminated in place in the workspace copy
+ * of the body, overwriting their closing quote, and only strings with a
+ * backslash go through unescape(). */
+static short
+compile_json(struct proxy_request *req, unsigned *idx, unsigned *type,
+             unsigned short lvl)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+    CHECK_OBJ_NOTNULL(req->ctx, VRT_CTX_MAGIC);
+    AN(req->body);
+    assert(req->json_toks_len > 0);
+    assert(*idx < (unsigned)req->json_toks_len);
+
+    char *json = req->body;
+    jsmntok_t tok = req->json_toks[*idx];
+
+    if (lvl == 0) { /* {lvl0} */
+        if (req->json_toks_len > 1 && tok.type != JSMN_OBJECT)
+            PROXY_REQ_ERROR_INT(req, "json error: root not object %i", req->json_toks_len);
+    }
+    else if (lvl == 1) { /* {'recv':[lvl1]} */
+        if (*type && tok.type != JSMN_ARRAY)
+            PROXY_REQ_ERROR_INT(req, "json error: lvl 1 not array%s", "");
+    }
     else if (lvl == 2) { /* {'recv':["lvl2"]} */
         if (*type && tok.type != JSMN_STRING)
             PROXY_REQ_ERROR_INT(req,
@@ -453,16 +1441,12 @@ process_json(struct proxy_request *req, unsigned short *idx,
         return 0;
     }
 
-    //PROXY_DEBUG(ctx, "--------%s", "");
-    //PROXY_DEBUG(ctx, "idx=%i type=%i size=%i lvl=%i", *idx, *type, tok.size, lvl);
-
     if (tok.type == JSMN_OBJECT || tok.type == JSMN_ARRAY) {
         lvl++;
 
         for (int i = 0; i < tok.size; i++) {
             (*idx)++;
-            //PROXY_DEBUG(ctx, "LOOP: idx=%i i=%i lvl=%i", *idx, i, lvl);
-            short res = process_json(req, idx, type, lvl);
+            short res = compile_json(req, idx, type, lvl);
             if (res == -1)
                 return res;
         }
@@ -471,7 +1455,7 @@ process_json(struct proxy_request *req, unsigned short *idx,
     }
     else {
         size_t len = (size_t)(tok.end - tok.start);
-        const char *s = json + tok.start;
+        char *s = json + tok.start;
 
         if (lvl == 1) {
             if (*type == 0) {
@@ -482,85 +1466,1436 @@ process_json(struct proxy_request *req, unsigned short *idx,
             }
         }
         else if (lvl == 2) {
-            struct http *hp = NULL;
-
             if (memchr(s, ':', len) == NULL)
                 return 0;
 
-            if (*type == VCL_MET_RECV && ctx->method == VCL_MET_RECV) {
-                //PROXY_DEBUG(ctx, "SHREQ: idx=%i type=%i", *idx, *type);
-                hp = ctx->http_req;
-                if (strncasecmp(s, H_Cookie + 1, H_Cookie[0]) == 0)
-                    req->collect_cookies = 1;
-            }
-            else if (*type == VCL_MET_DELIVER && ctx->method == VCL_MET_DELIVER &&
-                     ctx->req->esi_level == 0) {
-                //PROXY_DEBUG(ctx, "SHRES: idx=%i type=%i", *idx, *type);
-                hp = ctx->http_resp;
-            }
-            else
+            if (*type != VCL_MET_RECV && *type != VCL_MET_DELIVER)
                 return 0;
 
-            // Unescape string and copy to header
-            const char *sp;
-            char *hdr = WS_Alloc(ctx->ws, (unsigned)len + 1);
-            char *hdrp = hdr;
-            for (sp = s; sp < (s + len); sp++) {
-                if (*sp == '\\' && (sp + 1 < s + len)) {
-                    switch (*(sp + 1)) {
-                        case '\"': case '/': case '\\':
-                            sp++;
-                    }
-                }
-
-                memcpy(hdrp++, sp, 1L);
-            }
-            *hdrp = '\0';
-
-            // Handle various header names appropriately
-            if (*type == VCL_MET_RECV && ctx->method == VCL_MET_RECV) {
-                char nhdr[64];
-                const char *cp = memchr(hdr, ':', len);
-                AN(cp);
-                if ((cp - hdr) < 64) {
-                    memset(nhdr, 0, sizeof nhdr);
-                    nhdr[0] = (char)(cp - hdr + 1);
-                    strncpy((nhdr + 1), hdr, nhdr[0]);
-
-                    if (strncasecmp(hdr, H_Cookie + 1, H_Cookie[0]) != 0)
-                        http_Unset(hp, nhdr);
-                }
+            char *e = s + len;
+
+            if (memchr(s, '\\', len) != NULL) {
+                e = unescape(s, s, len);
+                if (e == NULL)
+                    PROXY_REQ_ERROR_INT(req,
+                        "json error: bad escape in header%s", "");
             }
+            *e = '\0';
 
-            http_SetHeader(hp, hdr);
+            if (add_header(req, *type, s, (size_t)(e - s)) == -1)
+                return -1;
         }
     }
 
     return 0;
 }
 
-void
-proxy_process_request(VRT_CTX, struct proxy_request *req)
+/* Parses straight into the free workspace, so there is no fixed limit on the
+ * number of tokens other than max, then keeps only the space actually used.
+ * Sets capped when parsing failed because max was reached. */
+static int
+parse_json(struct proxy_request *req, const char *json, size_t len,
+           unsigned max, int *capped)
 {
     CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
-    CHECK_OBJ_NOTNULL(req->json, VSB_MAGIC);
-    AZ(req->ctx);
+    CHECK_OBJ_NOTNULL(req->ctx, VRT_CTX_MAGIC);
+    AN(capped);
 
-    if (req->json_toks_len <= 0)
-        return;
+    struct ws *ws = req->ctx->ws;
+    unsigned avail = WS_Reserve(ws, 0);
+    char *f = ws->f;
+    unsigned pad = (unsigned)(-(uintptr_t)f & (sizeof(void *) - 1));
+    unsigned num = avail > pad ? (avail - pad) / sizeof(jsmntok_t) : 0;
 
-    unsigned short idx = 0;
-    unsigned type = 0;
+    *capped = 0;
+    if (num >= max)
+        num = max;
 
-    PROXY_LOG(ctx, "start%s", "");
+    jsmntok_t *toks = (jsmntok_t *)(void *)(f + pad);
+    jsmn_parser parser;
+    jsmn_init(&parser);
 
-    AZ(req->ctx);
-    req->ctx = ctx;
-    process_json(req, &idx, &type, 0);
-    req->ctx = NULL;
+    int r = jscan_parse(&parser, json, len, toks, num);
+
+    if (r < 0) {
+        WS_Release(ws, 0);
+        if (r == JSMN_ERROR_NOMEM && num == max)
+            *capped = 1;
+        return r;
+    }
 
-    if (ctx->method == VCL_MET_RECV && req->collect_cookies)
-        collect_header(ctx->http_req, H_Cookie, ';');
+    WS_Release(ws, pad + parser.toknext * sizeof *toks);
+    req->json_toks = toks;
+    req->json_toks_len = (int)parser.toknext;
 
-    PROXY_LOG(ctx, "end%s", "");
+    return req->json_toks_len;
+}
+
+/* Parses the compact response format, one record per header:
+ *
+ *     <R|D> <length> <name: value>\n
+ *
+ * R records are request headers, D records response headers, and length is
+ * the number of bytes of "name: value". Nothing is escaped, so the body is
+ * copied to the workspace once and the header lists point straight into it. */
+static int
+parse_compact(struct proxy_request *req, const char *body, size_t len)
+{
+    const struct vrt_ctx *ctx = req->ctx;
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+
+    if (len > PROXY_BODY_MAX)
+        PROXY_REQ_ERROR_INT(req, "parse: body too big (%zu)", len);
+
+    if (req->body == NULL) {
+        req->body = WS_Copy(ctx->ws, body, (int)len + 1);
+        if (req->body == NULL)
+            PROXY_REQ_ERROR_INT(req, "parse: out of workspace%s", "");
+    }
+    char *buf = req->body;
+
+    char *p, *end = buf + len;
+    unsigned n = 0;
+
+    /* Every record ends with a newline, so this is an upper bound */
+    for (p = buf; (p = memchr(p, '\n', (size_t)(end - p))) != NULL; p++)
+        n++;
+
+    size_t hdrs_size = n * sizeof(struct proxy_header);
+    req->recv_hdrs = WS_Alloc(ctx->ws, hdrs_size);
+    req->deliver_hdrs = WS_Alloc(ctx->ws, hdrs_size);
+
+    if (req->recv_hdrs == NULL || req->deliver_hdrs == NULL)
+        PROXY_REQ_ERROR_INT(req, "parse: out of workspace%s", "");
+
+    for (p = buf; p < end;) {
+        unsigned type;
+
+        if (*p == 'R')
+            type = VCL_MET_RECV;
+        else if (*p == 'D')
+            type = VCL_MET_DELIVER;
+        else
+            PROXY_REQ_ERROR_INT(req, "parse: bad record at byte %zu", p - buf);
+
+        if (p[1] != ' ' || !isdigit((unsigned char)p[2]))
+            PROXY_REQ_ERROR_INT(req, "parse: bad record at byte %zu", p - buf);
+
+        char *e;
+        unsigned long rlen = strtoul(p + 2, &e, 10);
+
+        if (*e != ' ' || (size_t)(end - e) < 2 ||
+            rlen > (size_t)(end - e) - 2 || e[rlen + 1] != '\n')
+            PROXY_REQ_ERROR_INT(req, "parse: bad record at byte %zu", p - buf);
+
+        char *hdr = e + 1;
+
+        /* Nothing is escaped, a line break would split the header */
+        if (memchr(hdr, '\r', rlen) || memchr(hdr, '\n', rlen) ||
+            memchr(hdr, '\0', rlen))
+            PROXY_REQ_ERROR_INT(req, "parse: bad record at byte %zu", p - buf);
+
+        hdr[rlen] = '\0';
+        p = hdr + rlen + 1;
+
+        if (memchr(hdr, ':', rlen) == NULL)
+            continue;
+
+        if (add_header(req, type, hdr, rlen) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Parses the response body and compiles it into the header lists */
+static int
+parse_body(struct proxy_request *req, unsigned compact)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+    CHECK_OBJ_NOTNULL(req->json, VSB_MAGIC);
+
+    const struct vrt_ctx *ctx = req->ctx;
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+
+    if (compact)
+        return parse_compact(req, VSB_data(req->json),
+            (size_t)VSB_len(req->json));
+
+    char *json = VSB_data(req->json);
+    size_t json_len = (size_t)VSB_len(req->json);
+
+    /* Bodies received by curl were parsed as they arrived, so they were held
+     * to PROXY_BODY_MAX and had their first byte checked already */
+    unsigned streamed = req->stream.state == STREAM_JSON;
+
+    if (!streamed) {
+        json_len = strlen(json);
+
+        if (json_len == 0)
+            PROXY_REQ_ERROR_INT(req, "parse: no body%s", "");
+
+        if (json_len > PROXY_BODY_MAX)
+            PROXY_REQ_ERROR_INT(req, "parse: body too big (%zu)", json_len);
+    }
+
+    /* Headers are referenced in place, so they must live in the workspace */
+    if (req->body == NULL) {
+        req->body = WS_Copy(ctx->ws, json, (int)json_len + 1);
+        if (req->body == NULL)
+            PROXY_REQ_ERROR_INT(req, "parse: out of workspace%s", "");
+    }
+    json = req->body;
+
+    unsigned max = req->config ? req->config->max_tokens : JSON_MAX_TOKENS;
+
+    if (streamed) {
+        const jsmntok_t *toks;
+        unsigned ntoks;
+
+        /* Only the tokens are left to move into the workspace */
+        int s = stream_finish(&req->stream, &toks, &ntoks);
+        assert(s != 0);
+
+        if (s == -1 && req->stream.error == STREAM_TOO_MANY_TOKENS)
+            PROXY_REQ_ERROR_INT(req, "parse: too many tokens (max %u)", max);
+        else if (s == -1)
+            PROXY_REQ_ERROR_INT(req, "parse: failed to parse json%s", "");
+
+        /* White space only, or something after the object or array */
+        if (ntoks == 0 || toks[ntoks - 1].end > toks[0].end)
+            PROXY_REQ_ERROR_INT(req, "parse: bad delimiters%s", "");
+
+        req->json_toks = WS_Alloc(ctx->ws, ntoks * sizeof *toks);
+        if (req->json_toks == NULL)
+            PROXY_REQ_ERROR_INT(req, "parse: out of workspace%s", "");
+        memcpy(req->json_toks, toks, ntoks * sizeof *toks);
+        req->json_toks_len = (int)ntoks;
+        stream_fini(&req->stream);
+    }
+    else {
+        /* Save expensive json parse if doesnt open and close with {} or [].
+         * Only the white space at either end needs looking at. */
+        const char *fc = json, *lc = json + json_len - 1;
+        while (fc < lc && isspace((unsigned char)*fc))
+            fc++;
+        while (lc > fc && isspace((unsigned char)*lc))
+            lc--;
+
+        if ((*fc != '{' && *fc != '[') || (*lc != '}' && *lc != ']'))
+            PROXY_REQ_ERROR_INT(req, "parse: bad delimiters%s", "");
+
+        int capped = 0;
+        int r = parse_json(req, json, json_len, max, &capped);
+
+        if (r == JSMN_ERROR_NOMEM && capped)
+            PROXY_REQ_ERROR_INT(req, "parse: too many tokens (max %u)", max);
+        else if (r == JSMN_ERROR_NOMEM)
+            PROXY_REQ_ERROR_INT(req, "parse: out of workspace%s", "");
+        else if (r < 0)
+            PROXY_REQ_ERROR_INT(req, "parse: failed to parse json%s", "");
+    }
+
+    /* Every header needs its own string token, so this is an upper bound */
+    size_t hdrs_size = req->json_toks_len * sizeof(struct proxy_header);
+    req->recv_hdrs = WS_Alloc(ctx->ws, hdrs_size);
+    req->deliver_hdrs = WS_Alloc(ctx->ws, hdrs_size);
+
+    if (req->recv_hdrs == NULL || req->deliver_hdrs == NULL)
+        PROXY_REQ_ERROR_INT(req, "parse: out of workspace%s", "");
+
+    unsigned idx = 0, type = 0;
+    if (compile_json(req, &idx, &type, 0) == -1)
+        return -1;
+
+    return 0;
+}
+
+/* Parses a response body already in req->json, whichever transport brought
+ * it, and stores it in the cache */
+static void
+finish_response(struct proxy_request *req, long status, unsigned compact)
+{
+    const struct vrt_ctx *ctx = req->ctx;
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+
+    // Non 200 responses should report error, but still attempt to process json
+    if (status != 200) {
+        snprintf(req->errbuf, sizeof req->errbuf, "curl err: %lu response",
+            status);
+        req->error = req->errbuf;
+        VSLb(ctx->vsl, SLT_Error, PROXY_NAME ": curl err: %lu response", status);
+        errlog_status(status);
+        STATS_INC(non200);
+    }
+
+    if (parse_body(req, compact) == -1) {
+        /* Lists compiled up to the failure stay in the workspace, and none
+         * of their headers apply */
+        req->recv_hdrs = req->deliver_hdrs = NULL;
+        req->recv_len = req->deliver_len = 0;
+        req->collect_cookies = 0;
+        STATS_INC(parse_fail);
+        return;
+    }
+
+    keep_plan(req, NULL, 0);
+
+    if (req->error == NULL)
+        STATS_INC(success);
+
+    if (req->cache_key && req->error == NULL)
+        cache_store(req);
+
+    req->ctx = NULL;
+
+    // int l;
+    // char t[255];
+    // for (int a = 0; a < request_toks_len; a++) {
+    //     l = req->json_toks[a].end - req->json_toks[a].start;
+    //     memcpy(t, json + req->json_toks[a].start, (l < 255 ? l : 255));
+    //     t[l] = '\0';
+    //     PROXY_DEBUG(ctx, "parse_response idx=%i size:%i type=%i val:%s",
+    //         a, req->json_toks[a].size, req->json_toks[a].type, t);
+    // }
+}
+
+/* Reports why the body was refused while it was being received */
+static void
+stream_failed(struct proxy_request *req)
+{
+    unsigned max = req->config ? req->config->max_tokens : JSON_MAX_TOKENS;
+
+    switch (req->stream.error) {
+    case STREAM_DELIMITERS:
+        PROXY_REQ_ERROR_VOID(req, "parse: bad delimiters%s", "");
+    case STREAM_INVALID:
+        PROXY_REQ_ERROR_VOID(req, "parse: failed to parse json%s", "");
+    case STREAM_TOO_MANY_TOKENS:
+        PROXY_REQ_ERROR_VOID(req, "parse: too many tokens (max %u)", max);
+    default:
+        PROXY_REQ_ERROR_VOID(req, "parse: body over %d bytes", PROXY_BODY_MAX);
+    }
+}
+
+/* Hands the curl handle back to the pool and parses the response body.
+ * headers are freed, sync calls pass NULL as theirs are the request's. */
+static void
+curl_finish(struct proxy_request *req, CURL *ch, struct curl_slist *headers,
+            CURLcode ret)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+    CHECK_OBJ_NOTNULL(req->json, VSB_MAGIC);
+    AN(ch);
+
+    const struct vrt_ctx *ctx = req->ctx;
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+
+    long status;
+    curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
+
+    double connect = 0, ttfb = 0, total = 0, bytes = 0;
+    curl_easy_getinfo(ch, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(ch, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+    curl_easy_getinfo(ch, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(ch, CURLINFO_SIZE_DOWNLOAD, &bytes);
+
+    STATS_INC(calls);
+    STATS_ADD(bytes, bytes);
+    stats_latency(connect, ttfb, total);
+
+    if (req->breaker) {
+        breaker_report(req->breaker, (ret == CURLE_OK && status < 500), total);
+        req->breaker = NULL;
+    }
+
+    /* Only valid until the handle is reused */
+    char *type = NULL;
+    curl_easy_getinfo(ch, CURLINFO_CONTENT_TYPE, &type);
+    unsigned compact = is_compact(type);
+
+    free(headers);
+
+    pool_put(ch);
+
+    if (ret == CURLE_WRITE_ERROR) {
+        STATS_INC(parse_fail);
+        stream_failed(req);
+        return;
+    }
+
+    if (ret != 0) {
+        if (ret == CURLE_OPERATION_TIMEDOUT)
+            STATS_INC(curl_timeout);
+        else if (ret == CURLE_COULDNT_CONNECT)
+            STATS_INC(curl_connect);
+        else
+            STATS_INC(curl_other);
+
+        errlog_curl(ret);
+        PROXY_REQ_ERROR_VOID(req, "curl err: %s", curl_easy_strerror(ret));
+    }
+
+    finish_response(req, status, compact);
+}
+
+/* Takes over the response the loop collected for a finished job */
+static void
+job_finish(struct proxy_request *req, struct async_job *job)
+{
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+
+    release_body(req);
+    req->json = job->body;
+    job->body = NULL;
+    stream_move(&req->stream, &job->stream);
+    VSB_finish(req->json);
+    req->script_ttl = job->script_ttl;
+
+    CURL *ch = job->ch;
+    struct curl_slist *headers = job->headers;
+    CURLcode ret = job->result;
+    job->ch = NULL;
+    job->headers = NULL;
+    async_release(job);
+
+    curl_finish(req, ch, headers, ret);
+}
+
+/* Runs the call on the multi handle of the async loop and waits for it. A
+ * pooled easy handle only reuses its own connections, so http2 calls go
+ * through the loop to multiplex onto the connections all workers share. */
+static void
+curl_shared(VRT_CTX, struct proxy_request *req, const struct director *dir,
+            const char *path)
+{
+    struct async_job *job = async_job_new();
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+
+    job->ch = curl_prepare(ctx, req, dir, path, job, &job->headers);
+    if (job->ch == NULL) {
+        async_release(job);
+        return;
+    }
+
+    async_submit(job);
+    AN(async_wait(job, 0));
+
+    job_finish(req, job);
+}
+
+/* Starts a hedge call on another backend of the director. Never fails the
+ * request, when no other healthy backend can take it the primary call just
+ * goes on alone. */
+static struct async_job *
+hedge_start(VRT_CTX, struct proxy_request *req, const struct director *dir,
+            const struct backend *primary, const char *path,
+            struct breaker **breakerp)
+{
+    const struct director *rdir = NULL;
+    const struct backend *be = NULL;
+    struct breaker *b = NULL;
+    double connect, total;
+
+    for (int i = 0; i < PROXY_HEDGE_TRIES && (be == NULL || be == primary); i++)
+        be = get_backend(ctx, ctx->req->wrk, dir, &rdir);
+
+    if (be == NULL || be == primary || !call_timeouts(ctx, req, be, &connect,
+        &total)) {
+        STATS_INC(hedge_skipped);
+        return NULL;
+    }
+
+    if (req->config->breakers) {
+        CHECK_OBJ_NOTNULL(rdir, DIRECTOR_MAGIC);
+
+        b = breaker_get(req->config->breakers, be);
+        if ((rdir->healthy && !rdir->healthy(rdir, NULL, NULL)) ||
+            !breaker_allow(b)) {
+            STATS_INC(hedge_skipped);
+            return NULL;
+        }
+    }
+
+    struct async_job *job = async_job_new();
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+
+    job->ch = curl_handle(ctx, req, be, rdir, path, job, connect, total,
+        &job->headers);
+    AN(job->ch);
+
+    async_submit(job);
+    STATS_INC(hedges);
+
+    PROXY_DEBUG(ctx, "hedge sent after %.3fs", req->config->hedge_delay);
+
+    *breakerp = b;
+    return job;
+}
+
+static int
+job_ok(struct async_job *job)
+{
+    long status = 0;
+
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+
+    if (job->result != CURLE_OK)
+        return 0;
+
+    curl_easy_getinfo(job->ch, CURLINFO_RESPONSE_CODE, &status);
+    return (status < 500);
+}
+
+/* Makes the call on the multi handle, and when it has not answered within
+ * the hedge delay, the same call on another backend. The first good answer
+ * wins and the other call is cancelled. */
+static void
+curl_hedged(VRT_CTX, struct proxy_request *req, const struct director *dir,
+            const char *path)
+{
+    struct async_job *jobs[2];
+    struct breaker *breakers[2] = { NULL, NULL };
+    unsigned n = 1;
+    int w;
+
+    jobs[0] = async_job_new();
+    CHECK_OBJ_NOTNULL(jobs[0], ASYNC_JOB_MAGIC);
+
+    jobs[0]->ch = curl_prepare(ctx, req, dir, path, jobs[0], &jobs[0]->headers);
+    if (jobs[0]->ch == NULL) {
+        async_release(jobs[0]);
+        return;
+    }
+
+    double start = VTIM_mono();
+    breakers[0] = req->breaker;
+    async_submit(jobs[0]);
+
+    if (!async_wait(jobs[0], req->config->hedge_delay)) {
+        jobs[1] = hedge_start(ctx, req, dir, req->backend, path, &breakers[1]);
+        if (jobs[1])
+            n = 2;
+    }
+
+    w = async_wait_any(jobs, n, 0);
+    assert(w >= 0);
+
+    /* A fast failure does not win while the other call may still answer */
+    if (n == 2 && !job_ok(jobs[w])) {
+        if (breakers[w])
+            breaker_report(breakers[w], 0, VTIM_mono() - start);
+        async_release(jobs[w]);
+
+        w = 1 - w;
+        jobs[0] = jobs[w];
+        breakers[0] = breakers[w];
+        n = 1;
+        w = 0;
+        AN(async_wait(jobs[0], 0));
+    }
+
+    if (n == 2) {
+        /* A primary that lost was too slow, a hedge that lost was not */
+        if (breakers[1 - w])
+            breaker_report(breakers[1 - w], w == 1 ? 0 : 1,
+                VTIM_mono() - start);
+        async_release(jobs[1 - w]);
+
+        if (w == 1)
+            STATS_INC(hedge_wins);
+    }
+
+    req->breaker = breakers[w];
+    job_finish(req, jobs[w]);
+}
+
+/* Writes the request for a sidecar into its slot: the script path, the
+ * method, the url and the forwarded headers, one per line. Returns the
+ * length, or 0 when it does not fit. */
+static size_t
+sidecar_request(VRT_CTX, const struct proxy_request *req, const char *path,
+                struct shmring_slot *slot)
+{
+    const struct http *hp = ctx->http_req;
+    struct vsb vsb;
+
+    AN(VSB_new(&vsb, slot->req, SHMRING_REQ_MAX, VSB_FIXEDLEN));
+
+    VSB_printf(&vsb, "%s\n", path);
+    VSB_bcat(&vsb, hp->hd[HTTP_HDR_METHOD].b, Tlen(hp->hd[HTTP_HDR_METHOD]));
+    VSB_putc(&vsb, '\n');
+    VSB_bcat(&vsb, hp->hd[HTTP_HDR_URL].b, Tlen(hp->hd[HTTP_HDR_URL]));
+    VSB_putc(&vsb, '\n');
+
+    for (unsigned u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
+        const txt hdr = hp->hd[u];
+
+        if (!forward_header(req->config, &hdr))
+            continue;
+        VSB_bcat(&vsb, hdr.b, Tlen(hdr));
+        VSB_putc(&vsb, '\n');
+    }
+
+    size_t len = VSB_finish(&vsb) == 0 ? (size_t)VSB_len(&vsb) : 0;
+    VSB_delete(&vsb);
+    return len;
+}
+
+/* Hands the call to a local sidecar over shared memory and waits for the
+ * answer, which is copied into the workspace and parsed like a response of
+ * the web script. No backend is resolved, so breakers and hedging do not
+ * apply. */
+static void
+sidecar_call(VRT_CTX, struct proxy_request *req, struct shmring *ring,
+             const char *path)
+{
+    double timeout = PROXY_SIDECAR_TIMEOUT;
+
+    if (req->budget > 0) {
+        timeout = budget_left(ctx, req);
+        if (timeout < PROXY_BUDGET_MIN)
+            PROXY_REQ_ERROR_VOID(req, "budget: exhausted%s", "");
+    }
+
+    struct shmring_slot *slot = shmring_get(ring);
+    if (slot == NULL)
+        PROXY_REQ_ERROR_VOID(req, "sidecar: not available%s", "");
+
+    size_t len = sidecar_request(ctx, req, path, slot);
+    if (len == 0) {
+        (void)shmring_put(ring, slot);
+        PROXY_REQ_ERROR_VOID(req, "sidecar: request over %d bytes",
+            SHMRING_REQ_MAX);
+    }
+
+    double start = VTIM_mono();
+    if (shmring_submit(ring, slot, len) != 0)
+        PROXY_REQ_ERROR_VOID(req, "sidecar: bad slot state%s", "");
+
+    int w = shmring_wait(ring, slot, timeout);
+
+    if (w == 0) {
+        STATS_INC(sidecar_timeout);
+        PROXY_REQ_ERROR_VOID(req, "sidecar: timed out%s", "");
+    }
+    else if (w < 0)
+        PROXY_REQ_ERROR_VOID(req, "sidecar: bad slot state%s", "");
+
+    double total = VTIM_mono() - start;
+    long status = slot->status;
+    unsigned compact = (slot->type == SHMRING_TYPE_COMPACT);
+    len = slot->resp_len;
+
+    STATS_INC(calls);
+    STATS_INC(sidecar_calls);
+    STATS_ADD(bytes, len);
+    stats_latency(0, total, total);
+
+    if (len > PROXY_BODY_MAX) {
+        (void)shmring_put(ring, slot);
+        STATS_INC(parse_fail);
+        PROXY_REQ_ERROR_VOID(req, "parse: body over %d bytes", PROXY_BODY_MAX);
+    }
+
+    /* The slot goes back to the ring right away, the body is parsed in
+     * place in the workspace */
+    unsigned avail = WS_Reserve(ctx->ws, 0);
+    if (avail < len + 1) {
+        WS_Release(ctx->ws, 0);
+        (void)shmring_put(ring, slot);
+        PROXY_REQ_ERROR_VOID(req, "sidecar: out of workspace%s", "");
+    }
+
+    char *b = ctx->ws->f;
+    AN(VSB_new(&req->json_ws, b, (int)len + 1, VSB_FIXEDLEN));
+    req->json = &req->json_ws;
+    VSB_bcat(req->json, slot->resp, len);
+
+    /* Unless the slot was still done, the response may be torn */
+    if (shmring_put(ring, slot) != 0) {
+        WS_Release(ctx->ws, 0);
+        release_body(req);
+        PROXY_REQ_ERROR_VOID(req, "sidecar: bad slot state%s", "");
+    }
+
+    AZ(VSB_finish(req->json));
+    WS_Release(ctx->ws, (unsigned)len + 1);
+    req->body = b;
+
+    finish_response(req, status, compact);
+}
+
+/* Runs the Lua script in this worker thread with the same request the web
+ * script would get, and parses the headers it returned like a compact
+ * response. No backend is resolved, so breakers and hedging do not apply. */
+static void
+script_run(VRT_CTX, struct proxy_request *req, const struct proxy_script *ps,
+           const char *path)
+{
+    const struct http *hp = ctx->http_req;
+    double timeout = SCRIPT_TIMEOUT;
+    unsigned n = 0;
+
+    if (ps->script == NULL)
+        PROXY_REQ_ERROR_VOID(req, "lua: %s", ps->error);
+
+    if (req->budget > 0) {
+        timeout = budget_left(ctx, req);
+        if (timeout < PROXY_BUDGET_MIN)
+            PROXY_REQ_ERROR_VOID(req, "budget: exhausted%s", "");
+    }
+
+    struct script_field *f = WS_Alloc(ctx->ws, hp->nhd * sizeof *f);
+    if (f == NULL)
+        PROXY_REQ_ERROR_VOID(req, "lua: out of workspace%s", "");
+
+    f[n].b = hp->hd[HTTP_HDR_METHOD].b;
+    f[n++].e = hp->hd[HTTP_HDR_METHOD].e;
+    f[n].b = hp->hd[HTTP_HDR_URL].b;
+    f[n++].e = hp->hd[HTTP_HDR_URL].e;
+
+    for (unsigned u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
+        if (!forward_header(req->config, &hp->hd[u]))
+            continue;
+        f[n].b = hp->hd[u].b;
+        f[n++].e = hp->hd[u].e;
+    }
+
+    /* The script writes its headers as compact records straight into the
+     * free workspace, where they are used in place */
+    unsigned avail = WS_Reserve(ctx->ws, 0);
+    int size = avail < PROXY_BODY_MAX + 1 ? (int)avail : PROXY_BODY_MAX + 1;
+    char *b = ctx->ws->f;
+
+    if (size == 0) {
+        WS_Release(ctx->ws, 0);
+        PROXY_REQ_ERROR_VOID(req, "lua: out of workspace%s", "");
+    }
+
+    AN(VSB_new(&req->json_ws, b, size, VSB_FIXEDLEN));
+    req->json = &req->json_ws;
+
+    double start = VTIM_mono();
+    int r = script_call(ps->script, path, f, n, timeout, req->json);
+    double total = VTIM_mono() - start;
+
+    stats_latency(0, total, total);
+
+    if (VSB_finish(req->json) != 0) {
+        WS_Release(ctx->ws, 0);
+        release_body(req);
+        if (size > PROXY_BODY_MAX)
+            PROXY_REQ_ERROR_VOID(req, "lua: headers over %d bytes",
+                PROXY_BODY_MAX);
+        PROXY_REQ_ERROR_VOID(req, "lua: out of workspace%s", "");
+    }
+
+    WS_Release(ctx->ws, (unsigned)VSB_len(req->json) + 1);
+
+    if (r != 0) {
+        const char *msg = VSB_data(req->json);
+        release_body(req);
+        PROXY_REQ_ERROR_VOID(req, "lua: %s", msg);
+    }
+
+    req->body = b;
+    finish_response(req, 200, 1);
+}
+
+/* Makes the web script call and waits for the response */
+static void
+curl_sync(VRT_CTX, struct proxy_request *req, const struct director *dir,
+          const char *path)
+{
+    const struct proxy_script *ps = get_script(req->config, dir);
+
+    if (ps) {
+        script_run(ctx, req, ps, path);
+        return;
+    }
+
+    struct shmring *ring = get_sidecar(req->config, dir);
+
+    if (ring) {
+        sidecar_call(ctx, req, ring, path);
+        return;
+    }
+
+    if (req->config && req->config->hedge_delay > 0) {
+        curl_hedged(ctx, req, dir, path);
+        return;
+    }
+
+    if (req->config && req->config->http2) {
+        curl_shared(ctx, req, dir, path);
+        return;
+    }
+
+    struct curl_slist *headers = NULL;
+    CURL *ch = curl_prepare(ctx, req, dir, path, NULL, &headers);
+    if (ch == NULL)
+        return;
+
+    /* Receive straight into the free workspace. Only a body that does not
+     * fit makes the vsb move to the heap. */
+    unsigned avail = WS_Reserve(ctx->ws, 0);
+    char *b = avail > 0 ? ctx->ws->f : NULL;
+    int size = avail < PROXY_BODY_MAX + 1 ? (int)avail : PROXY_BODY_MAX + 1;
+
+    AN(VSB_new(&req->json_ws, b, b ? size : 0, VSB_AUTOEXTEND));
+    req->json = &req->json_ws;
+    stream_init(&req->stream, req->json, ch, PROXY_BODY_MAX,
+        req->config ? req->config->max_tokens : JSON_MAX_TOKENS, 1);
+    curl_easy_setopt(ch, CURLOPT_WRITEDATA, &req->stream);
+
+    CURLcode ret = curl_easy_perform(ch);
+
+    VSB_finish(req->json);
+    if (b && VSB_data(req->json) == b) {
+        WS_Release(ctx->ws, (unsigned)VSB_len(req->json) + 1);
+        req->body = b;
+    }
+    else
+        WS_Release(ctx->ws, 0);
+
+    curl_finish(req, ch, NULL, ret);
+
+    /* Its tokens are in the buffer of this thread */
+    stream_fini(&req->stream);
+}
+
+/* Joins the call that another request with the same flight key has in
+ * flight, or makes it on behalf of every request that joins meanwhile */
+static void
+flight_call(VRT_CTX, struct proxy_request *req, const struct director *dir,
+            const char *path)
+{
+    int leader;
+    struct flight *f = flight_join(req->flight_key, &leader);
+
+    if (leader) {
+        curl_sync(ctx, req, dir, path);
+
+        size_t len = 0;
+        char *data = NULL;
+
+        if (req->error == NULL) {
+            AN(req->plan);
+            len = req->plan->len;
+            data = malloc(len);
+            AN(data);
+            memcpy(data, req->plan->data, len);
+        }
+        flight_done(f, data, len);
+        flight_release(f);
+        return;
+    }
+
+    PROXY_DEBUG(ctx, "flight follow key:%s", req->flight_key);
+
+    if (!flight_wait(f, req->flight_wait)) {
+        flight_release(f);
+        PROXY_REQ_ERROR_VOID(req, "flight: leader timed out%s", "");
+    }
+
+    size_t len;
+    const char *data = flight_data(f, &len);
+
+    if (data == NULL) {
+        flight_release(f);
+        PROXY_REQ_ERROR_VOID(req, "flight: leader failed%s", "");
+    }
+
+    keep_plan(req, data, len);
+    flight_release(f);
+
+    req->ctx = NULL;
+}
+
+void
+proxy_curl(VRT_CTX, struct proxy_request *req, const struct director *dir,
+            const char *path)
+{
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+
+    PROXY_DEBUG(ctx, "proxy_curl%s", "");
+
+    reset_call(req);
+
+    AZ(req->ctx);
+    req->ctx = ctx;
+
+    if (req->cache_key && scope_cache_key(req, dir, path) == -1)
+        return;
+
+    if (req->cache_key && cache_fetch(req)) {
+        PROXY_DEBUG(ctx, "cache hit key:%s", req->cache_key);
+        req->ctx = NULL;
+        return;
+    }
+
+    if (req->flight_key)
+        flight_call(ctx, req, dir, path);
+    else
+        curl_sync(ctx, req, dir, path);
+}
+
+void
+proxy_start(VRT_CTX, struct proxy_request *req, const struct director *dir,
+            const char *path)
+{
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+
+    PROXY_DEBUG(ctx, "proxy_start%s", "");
+
+    reset_call(req);
+
+    AZ(req->ctx);
+    req->ctx = ctx;
+
+    if (req->cache_key && scope_cache_key(req, dir, path) == -1)
+        return;
+
+    if (req->cache_key && cache_fetch(req)) {
+        PROXY_DEBUG(ctx, "cache hit key:%s", req->cache_key);
+        req->ctx = NULL;
+        return;
+    }
+
+    struct async_job *job = async_job_new();
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+
+    job->ch = curl_prepare(ctx, req, dir, path, job, &job->headers);
+    if (job->ch == NULL) {
+        async_release(job);
+        return;
+    }
+
+    async_submit(job);
+    req->async = job;
+    req->ctx = NULL;
+}
+
+void
+proxy_wait(VRT_CTX, struct proxy_request *req, double timeout)
+{
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+
+    if (req->async == NULL)
+        return;
+
+    PROXY_DEBUG(ctx, "proxy_wait%s", "");
+
+    struct async_job *job = req->async;
+    CHECK_OBJ_NOTNULL(job, ASYNC_JOB_MAGIC);
+    req->async = NULL;
+
+    AZ(req->ctx);
+    req->ctx = ctx;
+
+    if (!async_wait(job, timeout)) {
+        async_release(job);
+        if (req->breaker) {
+            breaker_report(req->breaker, 0, timeout);
+            req->breaker = NULL;
+        }
+        PROXY_REQ_ERROR_VOID(req, "async: deadline exceeded%s", "");
+    }
+
+    job_finish(req, job);
+}
+
+/* Appends a json string, escaping what json requires */
+static void
+json_string(struct vsb *vsb, const char *b, const char *e)
+{
+    VSB_putc(vsb, '"');
+    for (; b < e; b++) {
+        unsigned char c = (unsigned char)*b;
+
+        if (c == '"' || c == '\\')
+            VSB_printf(vsb, "\\%c", c);
+        else if (c < 0x20)
+            VSB_printf(vsb, "\\u%04x", c);
+        else
+            VSB_putc(vsb, c);
+    }
+    VSB_putc(vsb, '"');
+}
+
+/* Serializes the request, and the response status in vcl_deliver, as one
+ * json line. Headers follow the forward rules of the VCL. */
+static void
+notify_event(VRT_CTX, const struct proxy_config *cfg, struct vsb *vsb)
+{
+    const struct http *hp = ctx->http_req;
+    const char *sep = "";
+
+    CHECK_OBJ_NOTNULL(hp, HTTP_MAGIC);
+
+    VSB_cat(vsb, "{\"method\": ");
+    json_string(vsb, hp->hd[HTTP_HDR_METHOD].b, hp->hd[HTTP_HDR_METHOD].e);
+    VSB_cat(vsb, ", \"url\": ");
+    json_string(vsb, hp->hd[HTTP_HDR_URL].b, hp->hd[HTTP_HDR_URL].e);
+
+    if (ctx->http_resp)
+        VSB_printf(vsb, ", \"status\": %u", ctx->http_resp->status);
+
+    VSB_cat(vsb, ", \"headers\": [");
+    for (unsigned u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
+        const txt hdr = hp->hd[u];
+
+        if (hdr.b == NULL || !forward_header(cfg, &hdr))
+            continue;
+
+        VSB_cat(vsb, sep);
+        json_string(vsb, hdr.b, hdr.e);
+        sep = ", ";
+    }
+    VSB_cat(vsb, "]}");
+}
+
+void
+proxy_notify(VRT_CTX, const struct proxy_config *cfg,
+             const struct director *dir, const char *path)
+{
+    struct vsb vsb[1];
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+    CHECK_OBJ_ORNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    const struct director *rdir = NULL;
+    const struct backend *be = get_backend(ctx, ctx->req->wrk, dir, &rdir);
+    CHECK_OBJ_ORNULL(be, BACKEND_MAGIC);
+
+    if (be == NULL)
+        PROXY_ERROR_VOID(ctx, "notify: no backends available%s", "");
+
+    const char *sock = get_socket(cfg, rdir);
+    char *url = get_url(ctx, be, sock, path);
+    if (url == NULL)
+        PROXY_ERROR_VOID(ctx, "notify: out of workspace%s", "");
+
+    /* The ring takes a copy, so the event only borrows the workspace */
+    unsigned avail = WS_Reserve(ctx->ws, 0);
+    int size = avail < NOTIFY_EVENT_MAX ? (int)avail : NOTIFY_EVENT_MAX;
+    AN(VSB_new(vsb, ctx->ws->f, size, VSB_FIXEDLEN));
+
+    notify_event(ctx, cfg, vsb);
+
+    if (VSB_finish(vsb) != 0) {
+        VSB_delete(vsb);
+        WS_Release(ctx->ws, 0);
+        PROXY_ERROR_VOID(ctx, "notify: event too big%s", "");
+    }
+
+    long timeout = be->first_byte_timeout > 0 ?
+        timeout_ms(be->first_byte_timeout) : NOTIFY_TIMEOUT;
+    int queued = notify_submit(url, sock, timeout, VSB_data(vsb),
+        (size_t)VSB_len(vsb));
+
+    VSB_delete(vsb);
+    WS_Release(ctx->ws, 0);
+
+    if (!queued)
+        PROXY_ERROR_VOID(ctx, "notify: queue full%s", "");
+}
+
+void
+proxy_process_request(VRT_CTX, struct proxy_request *req)
+{
+    CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
+    AZ(req->ctx);
+
+    const struct proxy_header *hdrs;
+    unsigned len;
+    struct http *hp;
+
+    if (ctx->method == VCL_MET_RECV) {
+        hdrs = req->recv_hdrs;
+        len = req->recv_len;
+        hp = ctx->http_req;
+    }
+    else if (ctx->method == VCL_MET_DELIVER && ctx->req->esi_level == 0) {
+        hdrs = req->deliver_hdrs;
+        len = req->deliver_len;
+        hp = ctx->http_resp;
+    }
+    else
+        return;
+
+    if (len == 0)
+        return;
+
+    PROXY_LOG(ctx, "start%s", "");
+
+    if (ctx->method == VCL_MET_RECV)
+        STATS_ADD(recv_headers, len);
+    else
+        STATS_ADD(deliver_headers, len);
+
+    if (ctx->method == VCL_MET_DELIVER) {
+        for (unsigned i = 0; i < len; i++)
+            http_SetHeader(hp, hdrs[i].hdr);
+    }
+    else if ((len == 1 && !req->collect_cookies) ||
+        !apply_headers(hp, hdrs, len, req->collect_cookies)) {
+        /* A single header is one scan either way. Otherwise the workspace
+         * is nearly full, and it is one scan per header. */
+        for (unsigned i = 0; i < len; i++) {
+            if (hdrs[i].unset)
+                http_Unset(hp, hdrs[i].unset);
+            http_SetHeader(hp, hdrs[i].hdr);
+        }
+
+        if (req->collect_cookies)
+            collect_header(hp, H_Cookie, ';');
+    }
+
+    PROXY_LOG(ctx, "end%s", "");
+}
+
+void *
+proxy_config_new(void)
+{
+    struct proxy_config *cfg;
+
+    ALLOC_OBJ(cfg, PROXY_CONFIG_MAGIC);
+    AN(cfg);
+    cfg->id = __sync_add_and_fetch(&config_ids, 1);
+    cfg->fwd_mode = PROXY_FWD_ALL;
+    cfg->max_tokens = JSON_MAX_TOKENS;
+    VTAILQ_INIT(&cfg->sockets);
+    VTAILQ_INIT(&cfg->sidecars);
+    VTAILQ_INIT(&cfg->scripts);
+
+    return cfg;
+}
+
+void
+proxy_config_free(void *ptr)
+{
+    struct proxy_config *cfg;
+    CAST_OBJ_NOTNULL(cfg, ptr, PROXY_CONFIG_MAGIC);
+
+    struct proxy_socket *ps, *ps2;
+    VTAILQ_FOREACH_SAFE(ps, &cfg->sockets, list, ps2) {
+        VTAILQ_REMOVE(&cfg->sockets, ps, list);
+        free(ps->path);
+        FREE_OBJ(ps);
+    }
+
+    struct proxy_sidecar *sc, *sc2;
+    VTAILQ_FOREACH_SAFE(sc, &cfg->sidecars, list, sc2) {
+        VTAILQ_REMOVE(&cfg->sidecars, sc, list);
+        shmring_free(sc->ring);
+        FREE_OBJ(sc);
+    }
+
+    struct proxy_script *pl, *pl2;
+    VTAILQ_FOREACH_SAFE(pl, &cfg->scripts, list, pl2) {
+        VTAILQ_REMOVE(&cfg->scripts, pl, list);
+        script_free(pl->script);
+        free(pl->error);
+        FREE_OBJ(pl);
+    }
+
+    hdrset_free(cfg->fwd_headers);
+    breakers_free(cfg->breakers);
+    FREE_OBJ(cfg);
+}
+
+void
+proxy_config_forward(struct proxy_config *cfg, unsigned mode, const char *list)
+{
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    hdrset_free(cfg->fwd_headers);
+    cfg->fwd_headers = NULL;
+    cfg->fwd_mode = PROXY_FWD_ALL;
+
+    if (mode == PROXY_FWD_ALL || list == NULL)
+        return;
+
+    cfg->fwd_headers = hdrset_new(list);
+    cfg->fwd_mode = mode;
+}
+
+void
+proxy_config_max_tokens(struct proxy_config *cfg, long max)
+{
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    if (max > 0)
+        cfg->max_tokens = (unsigned)max;
+}
+
+void
+proxy_config_breaker(struct proxy_config *cfg, double rate, long min_calls,
+                     double max_latency, double cooldown)
+{
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    breakers_free(cfg->breakers);
+    cfg->breakers = NULL;
+
+    if (rate <= 0 || rate > 1 || cooldown <= 0)
+        return;
+
+    cfg->breakers = breakers_new(rate, min_calls > 0 ? (unsigned)min_calls : 1,
+        max_latency, cooldown);
+}
+
+void
+proxy_config_unix_socket(struct proxy_config *cfg, const struct director *dir,
+                         const char *path)
+{
+    struct proxy_socket *ps;
+
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+    CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
+
+    VTAILQ_FOREACH(ps, &cfg->sockets, list) {
+        if (ps->dir == dir)
+            break;
+    }
+
+    // An empty path goes back to tcp
+    if (path == NULL || *path == '\0') {
+        if (ps) {
+            VTAILQ_REMOVE(&cfg->sockets, ps, list);
+            free(ps->path);
+            FREE_OBJ(ps);
+        }
+        return;
+    }
+
+    if (ps == NULL) {
+        ALLOC_OBJ(ps, PROXY_SOCKET_MAGIC);
+        AN(ps);
+        ps->dir = dir;
+        VTAILQ_INSERT_TAIL(&cfg->sockets, ps, list);
+    }
+    else
+        free(ps->path);
+
+    ps->path = strdup(path);
+    AN(ps->path);
+}
+
+void
+proxy_config_sidecar(struct proxy_config *cfg, const struct director *dir,
+                     const char *path)
+{
+    struct proxy_sidecar *sc;
+
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+    CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
+
+    VTAILQ_FOREACH(sc, &cfg->sidecars, list) {
+        if (sc->dir == dir)
+            break;
+    }
+
+    if (sc) {
+        VTAILQ_REMOVE(&cfg->sidecars, sc, list);
+        shmring_free(sc->ring);
+        FREE_OBJ(sc);
+    }
+
+    // An empty path goes back to http
+    if (path == NULL || *path == '\0')
+        return;
+
+    ALLOC_OBJ(sc, PROXY_SIDECAR_MAGIC);
+    AN(sc);
+    sc->dir = dir;
+    sc->ring = shmring_new(path);
+    VTAILQ_INSERT_TAIL(&cfg->sidecars, sc, list);
+}
+
+void
+proxy_config_lua(struct proxy_config *cfg, const struct director *dir,
+                 const char *file)
+{
+    struct proxy_script *ps;
+
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+    CHECK_OBJ_NOTNULL(dir, DIRECTOR_MAGIC);
+
+    VTAILQ_FOREACH(ps, &cfg->scripts, list) {
+        if (ps->dir == dir)
+            break;
+    }
+
+    if (ps) {
+        VTAILQ_REMOVE(&cfg->scripts, ps, list);
+        script_free(ps->script);
+        free(ps->error);
+        FREE_OBJ(ps);
+    }
+
+    // An empty file goes back to calling the backend
+    if (file == NULL || *file == '\0')
+        return;
+
+    // A script that fails to load fails every call with the reason
+    ALLOC_OBJ(ps, PROXY_SCRIPT_MAGIC);
+    AN(ps);
+    ps->dir = dir;
+    ps->script = script_new(file, &ps->error);
+    VTAILQ_INSERT_TAIL(&cfg->scripts, ps, list);
+}
+
+void
+proxy_config_hedge(struct proxy_config *cfg, double delay)
+{
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    cfg->hedge_delay = delay > 0 ? delay : 0;
+}
+
+void
+proxy_config_http2(struct proxy_config *cfg, unsigned enable)
+{
+    CHECK_OBJ_NOTNULL(cfg, PROXY_CONFIG_MAGIC);
+
+    cfg->http2 = enable ? 1 : 0;
+}
+
+void
+proxy_notify_config(long batch, double interval, double max_wait)
+{
+    notify_config(batch > 0 ? (unsigned)batch : 0, interval, max_wait);
+}
+
+void
+proxy_set_cache_size(size_t bytes)
+{
+    rcache_set_max(bytes);
+}
+
+long
+proxy_stat(const char *name)
+{
+    struct pool_stats ps;
+    struct rcache_stats cs;
+    struct breaker_stats bs;
+    struct flight_stats fs;
+    struct notify_stats ns;
+    struct script_stats ss;
+
+    if (name == NULL)
+        return 0;
+
+    if (strncmp(name, "pool.", 5) == 0) {
+        pool_stats(&ps);
+
+        if (strcmp(name, "pool.hits") == 0)
+            return (long)ps.hits;
+        else if (strcmp(name, "pool.misses") == 0)
+            return (long)ps.misses;
+        else if (strcmp(name, "pool.evictions") == 0)
+            return (long)ps.evictions;
+    }
+    else if (strncmp(name, "cache.", 6) == 0) {
+        rcache_stats(&cs);
+
+        if (strcmp(name, "cache.hits") == 0)
+            return (long)cs.hits;
+        else if (strcmp(name, "cache.misses") == 0)
+            return (long)cs.misses;
+        else if (strcmp(name, "cache.inserts") == 0)
+            return (long)cs.inserts;
+        else if (strcmp(name, "cache.evictions") == 0)
+            return (long)cs.evictions;
+        else if (strcmp(name, "cache.bytes") == 0)
+            return (long)cs.bytes;
+    }
+    else if (strncmp(name, "errors.", 7) == 0)
+        return errlog_stat(name + 7);
+    else if (strncmp(name, "breaker.", 8) == 0) {
+        breaker_stats(&bs);
+
+        if (strcmp(name, "breaker.opens") == 0)
+            return (long)bs.opens;
+        else if (strcmp(name, "breaker.rejects") == 0)
+            return (long)bs.rejects;
+        else if (strcmp(name, "breaker.probes") == 0)
+            return (long)bs.probes;
+    }
+    else if (strncmp(name, "flight.", 7) == 0) {
+        flight_stats(&fs);
+
+        if (strcmp(name, "flight.leaders") == 0)
+            return (long)fs.leaders;
+        else if (strcmp(name, "flight.followers") == 0)
+            return (long)fs.followers;
+        else if (strcmp(name, "flight.timeouts") == 0)
+            return (long)fs.timeouts;
+        else if (strcmp(name, "flight.failures") == 0)
+            return (long)fs.failures;
+    }
+    else if (strncmp(name, "notify.", 7) == 0) {
+        notify_stats(&ns);
+
+        if (strcmp(name, "notify.queued") == 0)
+            return (long)ns.queued;
+        else if (strcmp(name, "notify.dropped") == 0)
+            return (long)ns.dropped;
+        else if (strcmp(name, "notify.sent") == 0)
+            return (long)ns.sent;
+        else if (strcmp(name, "notify.failed") == 0)
+            return (long)ns.failed;
+        else if (strcmp(name, "notify.batches") == 0)
+            return (long)ns.batches;
+    }
+    else if (strncmp(name, "lua.", 4) == 0) {
+        script_stats(&ss);
+
+        if (strcmp(name, "lua.states") == 0)
+            return (long)ss.states;
+        else if (strcmp(name, "lua.calls") == 0)
+            return (long)ss.calls;
+        else if (strcmp(name, "lua.errors") == 0)
+            return (long)ss.errors;
+    }
+    else if (strncmp(name, "proxy.", 6) == 0 ||
+             strncmp(name, "latency.", 8) == 0)
+        return stats_stat(name);
+
+    return 0;
+}
+
+/* Every counter known to proxy_stat(), one "name value" per line */
+void
+proxy_stats_dump(struct vsb *vsb)
+{
+    static const char * const names[] = {
+        "pool.hits", "pool.misses", "pool.evictions",
+        "cache.hits", "cache.misses", "cache.inserts", "cache.evictions",
+        "cache.bytes",
+        "errors.curl", "errors.parse", "errors.json", "errors.breaker",
+        "errors.async", "errors.flight", "errors.notify", "errors.budget",
+        "errors.sidecar", "errors.lua", "errors.backend", "errors.other",
+        "errors.http",
+        "breaker.opens", "breaker.rejects", "breaker.probes",
+        "flight.leaders", "flight.followers", "flight.timeouts",
+        "flight.failures",
+        "notify.queued", "notify.dropped", "notify.sent", "notify.failed",
+        "notify.batches",
+        "lua.states", "lua.calls", "lua.errors",
+        NULL
+    };
+
+    AN(vsb);
+
+    for (unsigned i = 0; names[i] != NULL; i++)
+        VSB_printf(vsb, "%s %ld\n", names[i], proxy_stat(names[i]));
+
+    stats_dump(vsb);
 }
@@ -1,8 +1,8 @@
 #ifndef PROXY_H
 #define PROXY_H
 
+#include <stdio.h>
 #include <time.h>
-#include <syslog.h>
 
 #include "vcl.h"
 #include "vrt.h"
@@ -13,6 +13,65 @@
 #include "cache/cache_backend.h"
 
 #include "jsmn.h"
+#include "jscan.h"
+#include "stream.h"
+#include "errlog.h"
+
+struct async_job;
+struct hdrset;
+struct breakers;
+struct breaker;
+struct shmring;
+struct script;
+struct proxy_plan;
+
+#define PROXY_FWD_ALL           0
+#define PROXY_FWD_ALLOW         1
+#define PROXY_FWD_DENY          2
+
+/* A backend reached over a unix domain socket instead of tcp */
+struct proxy_socket {
+    unsigned magic;
+#define PROXY_SOCKET_MAGIC 0x6A0C52E1
+    const struct director       *dir;
+    char                        *path;
+    VTAILQ_ENTRY(proxy_socket)  list;
+};
+
+/* A backend served by a local sidecar over shared memory, see shmring.h */
+struct proxy_sidecar {
+    unsigned magic;
+#define PROXY_SIDECAR_MAGIC 0x3E7B6D15
+    const struct director       *dir;
+    struct shmring              *ring;
+    VTAILQ_ENTRY(proxy_sidecar) list;
+};
+
+/* A backend replaced by a Lua script run in process, see script.c */
+struct proxy_script {
+    unsigned magic;
+#define PROXY_SCRIPT_MAGIC 0x4B19E6A3
+    const struct director       *dir;
+    struct script               *script;    /* NULL when it failed to load */
+    char                        *error;     /* Why it failed */
+    VTAILQ_ENTRY(proxy_script)  list;
+};
+
+/* Per VCL settings, held in PRIV_VCL */
+struct proxy_config {
+    unsigned magic;
+#define PROXY_CONFIG_MAGIC 0x2D5B90C4
+    unsigned                    id;             /* Of the VCL, in cache keys */
+    unsigned                    fwd_mode;
+    struct hdrset               *fwd_headers;
+    unsigned                    max_tokens;
+    struct breakers             *breakers;      /* NULL when disabled */
+    unsigned                    http2;          /* h2c prior knowledge */
+    double                      hedge_delay;    /* 0 when disabled */
+    VTAILQ_HEAD(, proxy_socket) sockets;
+    VTAILQ_HEAD(, proxy_sidecar) sidecars;
+    VTAILQ_HEAD(, proxy_script) scripts;
+};
 
 #define PROXY_CONNECT_TIMEOUT   -1
 #define PROXY_TIMEOUT           -1
@@ -20,19 +79,64 @@
 
 #define PROXY_NAME              "libvmod-headerproxy"
 #define PROXY_HEADER            "X-Vmod-HeaderProxy"
+#define PROXY_HEADER_TTL        PROXY_HEADER "-Ttl"
+
+/* Response Content-Type of the compact format, anything else is json */
+#define PROXY_TYPE_COMPACT      "application/x-headerproxy"
+
+#define PROXY_HEDGE_TRIES       3       /* Resolves to find another backend */
+
+#define PROXY_BUDGET_MIN        0.001   /* Least budget worth a call */
 
-#define JSON_MAX_TOKENS         32
+#define PROXY_SIDECAR_TIMEOUT   1.0     /* Seconds, unless a budget is set */
+
+#define PROXY_BODY_MAX          0x1FFFF /* Largest response body */
+
+#define JSON_MAX_TOKENS         4096    /* Default ceiling per response */
+
+#define PROXY_FREE_MAX          4       /* Released requests kept per thread */
+
+#define PROXY_ERROR_MAX         256     /* Longest error() message */
+
+/* A header from the web script, ready to be applied */
+struct proxy_header {
+    const char                  *hdr;       /* "Name: value" */
+    const char                  *unset;     /* http_Unset() form, or NULL */
+};
 
 struct proxy_request {
     unsigned magic;
 #define PROXY_REQUEST_MAGIC 0xFBA1C37A
     const struct vrt_ctx        *ctx;
-    struct vsb                  *json;
-    jsmntok_t                   json_toks[JSON_MAX_TOKENS];
-    uint16_t                    json_toks_len;
+    const struct proxy_config   *config;
+    struct vsb                  *json;          /* Response, or NULL */
+    struct vsb                  json_ws;        /* Over the workspace */
+    struct stream               stream;         /* Receive state of json */
+    char                        *body;          /* json in workspace */
+    jsmntok_t                   *json_toks;     /* In workspace */
+    int                         json_toks_len;
+    struct proxy_header         *recv_hdrs;     /* In workspace */
+    unsigned                    recv_len;
+    struct proxy_header         *deliver_hdrs;  /* In workspace */
+    unsigned                    deliver_len;
     uint8_t                     collect_cookies;
     uint16_t                    restarts;
     char                        *error;
+    char                        errbuf[PROXY_ERROR_MAX];
+    const char                  *cache_key;
+    double                      cache_ttl;
+    double                      script_ttl;
+    const char                  *flight_key;    /* Coalesce on this key */
+    double                      flight_wait;
+    double                      budget;         /* From t_req, 0 for none */
+    struct async_job            *async;
+    struct breaker              *breaker;       /* Awaiting call outcome */
+    const struct backend        *backend;       /* Last one called */
+    struct proxy_plan           *plan;          /* Headers of the call */
+    struct proxy_plan           *retired;       /* Earlier in the request */
+    char                        *hdr_block;     /* Of build_headers(), kept */
+    size_t                      hdr_size;
+    struct proxy_request        *next;          /* In the free list */
 };
 
 #ifdef DEBUG
@@ -49,10 +153,11 @@ struct proxy_request {
         VSLb(ctx->vsl, SLT_VCL_Log, PROXY_NAME ": " m, __VA_ARGS__); \
     } while (0)
 
+/* Syslog only gets a periodic summary of these, see errlog.c */
 #define PROXY_WARN(ctx, m, ...) \
     do { \
         VSLb(ctx->vsl, SLT_Error, PROXY_NAME ": " m, __VA_ARGS__); \
-        syslog(LOG_ERR, PROXY_NAME ": " m, __VA_ARGS__); \
+        errlog_count(m); \
     } while (0)
 
 #define PROXY_ERROR_INT(ctx, m, ...) \
@@ -64,7 +169,8 @@ struct proxy_request {
 #define PROXY_REQ_ERROR_INT(req, m, ...) \
     do { \
         AN(req->ctx); \
-        req->error = WS_Printf(req->ctx->ws, m, __VA_ARGS__); \
+        snprintf(req->errbuf, sizeof req->errbuf, m, __VA_ARGS__); \
+        req->error = req->errbuf; \
         PROXY_WARN(req->ctx, m, __VA_ARGS__); \
         req->ctx = NULL; \
         return -1; \
@@ -79,7 +185,8 @@ struct proxy_request {
 #define PROXY_REQ_ERROR_VOID(req, m, ...) \
     do { \
         AN(req->ctx); \
-        req->error = WS_Printf(req->ctx->ws, m, __VA_ARGS__); \
+        snprintf(req->errbuf, sizeof req->errbuf, m, __VA_ARGS__); \
+        req->error = req->errbuf; \
         PROXY_WARN(req->ctx, m, __VA_ARGS__); \
         req->ctx = NULL; \
         return; \
@@ -91,9 +198,22 @@ struct proxy_request {
         return NULL; \
     } while (0)
 
+#define PROXY_REQ_ERROR_NULL(req, m, ...) \
+    do { \
+        AN(req->ctx); \
+        snprintf(req->errbuf, sizeof req->errbuf, m, __VA_ARGS__); \
+        req->error = req->errbuf; \
+        PROXY_WARN(req->ctx, m, __VA_ARGS__); \
+        req->ctx = NULL; \
+        return NULL; \
+    } while (0)
+
 void
 proxy_init();
 
+void
+proxy_fini(void);
+
 struct proxy_request *
 proxy_create_request(VRT_CTX);
 
@@ -107,7 +227,64 @@ void
 proxy_curl(VRT_CTX, struct proxy_request *req, const struct director *dir,
             const char *path);
 
+void
+proxy_start(VRT_CTX, struct proxy_request *req, const struct director *dir,
+            const char *path);
+
+void
+proxy_wait(VRT_CTX, struct proxy_request *req, double timeout);
+
+void
+proxy_notify(VRT_CTX, const struct proxy_config *cfg,
+             const struct director *dir, const char *path);
+
 void
 proxy_process_request(VRT_CTX, struct proxy_request *req);
 
+void *
+proxy_config_new(void);
+
+void
+proxy_config_free(void *ptr);
+
+void
+proxy_config_forward(struct proxy_config *cfg, unsigned mode, const char *list);
+
+void
+proxy_config_max_tokens(struct proxy_config *cfg, long max);
+
+void
+proxy_config_breaker(struct proxy_config *cfg, double rate, long min_calls,
+                     double max_latency, double cooldown);
+
+void
+proxy_config_unix_socket(struct proxy_config *cfg, const struct director *dir,
+                         const char *path);
+
+void
+proxy_config_sidecar(struct proxy_config *cfg, const struct director *dir,
+                     const char *path);
+
+void
+proxy_config_lua(struct proxy_config *cfg, const struct director *dir,
+                 const char *file);
+
+void
+proxy_config_hedge(struct proxy_config *cfg, double delay);
+
+void
+proxy_config_http2(struct proxy_config *cfg, unsigned enable);
+
+void
+proxy_notify_config(long batch, double interval, double max_wait);
+
+void
+proxy_set_cache_size(size_t bytes);
+
+long
+proxy_stat(const char *name);
+
+void
+proxy_stats_dump(struct vsb *vsb);
+
 #endif
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vqueue.h"
+#include "vtim.h"
+
+#include "rcache.h"
+
+/* Process wide cache of proxy responses. Keys are spread over lock striped
+ * hash tables, each stripe with its own LRU list and share of the memory cap,
+ * so concurrent lookups for different keys rarely contend on the same lock.
+ * Objects are reference counted so callers can copy data out of a hit without
+ * holding the stripe lock. */
+struct rcache_obj {
+    unsigned magic;
+#define RCACHE_OBJ_MAGIC 0x5C1A7E02
+    unsigned                    refcnt;
+    uint32_t                    hash;
+    double                      expires;
+    size_t                      size;       /* Bytes accounted to the stripe */
+    char                        *key;
+    void                        *data;
+    size_t                      len;
+    VTAILQ_ENTRY(rcache_obj)    lru;
+    VLIST_ENTRY(rcache_obj)     chain;
+};
+
+VLIST_HEAD(rcache_chain, rcache_obj);
+VTAILQ_HEAD(rcache_lru, rcache_obj);
+
+struct rcache_stripe {
+    pthread_mutex_t             mtx;
+    struct rcache_chain         buckets[RCACHE_BUCKETS];
+    struct rcache_lru           lru;
+    size_t                      max;
+    struct rcache_stats         stats;
+};
+
+static struct rcache_stripe stripes[RCACHE_STRIPES];
+
+/* FNV-1a */
+static uint32_t
+hash_key(const char *key)
+{
+    uint32_t h = 2166136261U;
+
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static struct rcache_chain *
+get_bucket(struct rcache_stripe *s, uint32_t hash)
+{
+    return &s->buckets[(hash / RCACHE_STRIPES) % RCACHE_BUCKETS];
+}
+
+/* Caller must hold the stripe lock */
+static void
+unlink_obj(struct rcache_stripe *s, struct rcache_obj *obj)
+{
+    CHECK_OBJ_NOTNULL(obj, RCACHE_OBJ_MAGIC);
+
+    VLIST_REMOVE(obj, chain);
+    VTAILQ_REMOVE(&s->lru, obj, lru);
+    assert(s->stats.bytes >= obj->size);
+    s->stats.bytes -= obj->size;
+    rcache_deref(obj);
+}
+
+/* Caller must hold the stripe lock */
+static void
+evict(struct rcache_stripe *s, size_t need)
+{
+    struct rcache_obj *obj;
+
+    while (s->stats.bytes + need > s->max) {
+        obj = VTAILQ_LAST(&s->lru, rcache_lru);
+        if (obj == NULL)
+            break;
+        unlink_obj(s, obj);
+        s->stats.evictions++;
+    }
+}
+
+void
+rcache_init(size_t max_bytes)
+{
+    for (int i = 0; i < RCACHE_STRIPES; i++) {
+        struct rcache_stripe *s = &stripes[i];
+
+        AZ(pthread_mutex_init(&s->mtx, NULL));
+        for (int b = 0; b < RCACHE_BUCKETS; b++)
+            VLIST_INIT(&s->buckets[b]);
+        VTAILQ_INIT(&s->lru);
+        s->max = max_bytes / RCACHE_STRIPES;
+        memset(&s->stats, 0, sizeof s->stats);
+    }
+}
+
+void
+rcache_set_max(size_t max_bytes)
+{
+    for (int i = 0; i < RCACHE_STRIPES; i++) {
+        struct rcache_stripe *s = &stripes[i];
+
+        AZ(pthread_mutex_lock(&s->mtx));
+        s->max = max_bytes / RCACHE_STRIPES;
+        evict(s, 0);
+        AZ(pthread_mutex_unlock(&s->mtx));
+    }
+}
+
+struct rcache_obj *
+rcache_lookup(const char *key)
+{
+    struct rcache_obj *obj, *found = NULL;
+    uint32_t hash;
+
+    AN(key);
+    hash = hash_key(key);
+
+    struct rcache_stripe *s = &stripes[hash % RCACHE_STRIPES];
+    double now = VTIM_mono();
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    VLIST_FOREACH(obj, get_bucket(s, hash), chain) {
+        CHECK_OBJ_NOTNULL(obj, RCACHE_OBJ_MAGIC);
+        if (obj->hash != hash || strcmp(obj->key, key))
+            continue;
+
+        if (obj->expires <= now) {
+            unlink_obj(s, obj);
+            s->stats.evictions++;
+            break;
+        }
+
+        VTAILQ_REMOVE(&s->lru, obj, lru);
+        VTAILQ_INSERT_HEAD(&s->lru, obj, lru);
+        __sync_add_and_fetch(&obj->refcnt, 1);
+        found = obj;
+        break;
+    }
+
+    if (found)
+        s->stats.hits++;
+    else
+        s->stats.misses++;
+    AZ(pthread_mutex_unlock(&s->mtx));
+
+    return found;
+}
+
+void
+rcache_insert(const char *key, const void *data, size_t len, double ttl)
+{
+    struct rcache_obj *obj, *old;
+    size_t klen, size;
+
+    AN(key);
+    AN(data);
+
+    if (ttl <= 0)
+        return;
+
+    klen = strlen(key);
+    size = sizeof *obj + klen + 1 + len;
+
+    obj = calloc(1, size);
+    AN(obj);
+    obj->magic = RCACHE_OBJ_MAGIC;
+    obj->refcnt = 1;            /* Reference held by the table */
+    obj->hash = hash_key(key);
+    obj->expires = VTIM_mono() + ttl;
+    obj->size = size;
+    obj->key = (char *)(obj + 1);
+    memcpy(obj->key, key, klen + 1);
+    obj->data = obj->key + klen + 1;
+    memcpy(obj->data, data, len);
+    obj->len = len;
+
+    struct rcache_stripe *s = &stripes[obj->hash % RCACHE_STRIPES];
+    struct rcache_chain *bucket = get_bucket(s, obj->hash);
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    if (size > s->max) {
+        AZ(pthread_mutex_unlock(&s->mtx));
+        free(obj);
+        return;
+    }
+
+    VLIST_FOREACH(old, bucket, chain) {
+        if (old->hash == obj->hash && strcmp(old->key, key) == 0) {
+            unlink_obj(s, old);
+            break;
+        }
+    }
+
+    evict(s, size);
+
+    VLIST_INSERT_HEAD(bucket, obj, chain);
+    VTAILQ_INSERT_HEAD(&s->lru, obj, lru);
+    s->stats.bytes += size;
+    s->stats.inserts++;
+    AZ(pthread_mutex_unlock(&s->mtx));
+}
+
+const void *
+rcache_data(const struct rcache_obj *obj, size_t *len)
+{
+    CHECK_OBJ_NOTNULL(obj, RCACHE_OBJ_MAGIC);
+    AN(len);
+
+    *len = obj->len;
+    return obj->data;
+}
+
+void
+rcache_deref(struct rcache_obj *obj)
+{
+    CHECK_OBJ_NOTNULL(obj, RCACHE_OBJ_MAGIC);
+    assert(obj->refcnt > 0);
+
+    if (__sync_sub_and_fetch(&obj->refcnt, 1) == 0) {
+        obj->magic = 0;
+        free(obj);
+    }
+}
+
+void
+rcache_stats(struct rcache_stats *stats)
+{
+    AN(stats);
+    memset(stats, 0, sizeof *stats);
+
+    for (int i = 0; i < RCACHE_STRIPES; i++) {
+        struct rcache_stripe *s = &stripes[i];
+
+        AZ(pthread_mutex_lock(&s->mtx));
+        stats->hits += s->stats.hits;
+        stats->misses += s->stats.misses;
+        stats->inserts += s->stats.inserts;
+        stats->evictions += s->stats.evictions;
+        stats->bytes += s->stats.bytes;
+        AZ(pthread_mutex_unlock(&s->mtx));
+    }
+}
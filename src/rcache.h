@@ -0,0 +1,42 @@
+#ifndef RCACHE_H
+#define RCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RCACHE_STRIPES          16
+#define RCACHE_BUCKETS          256     /* Hash buckets per stripe */
+#define RCACHE_MAX_BYTES        (16 * 1024 * 1024)
+
+struct rcache_obj;
+
+struct rcache_stats {
+    uint64_t                    hits;
+    uint64_t                    misses;
+    uint64_t                    inserts;
+    uint64_t                    evictions;  /* LRU and expired removals */
+    uint64_t                    bytes;      /* Current memory in use */
+};
+
+void
+rcache_init(size_t max_bytes);
+
+void
+rcache_set_max(size_t max_bytes);
+
+struct rcache_obj *
+rcache_lookup(const char *key);
+
+void
+rcache_insert(const char *key, const void *data, size_t len, double ttl);
+
+const void *
+rcache_data(const struct rcache_obj *obj, size_t *len);
+
+void
+rcache_deref(struct rcache_obj *obj);
+
+void
+rcache_stats(struct rcache_stats *stats);
+
+#endif
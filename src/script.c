@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#ifdef HAVE_LUA
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#ifdef LUA_JITLIBNAME
+#include <luajit.h>
+#endif
+#endif
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vqueue.h"
+#include "vsb.h"
+#include "vtim.h"
+
+#include "script.h"
+
+/* Lua scripts run in process instead of calling the web script. The source is
+ * read once per VCL, and each worker thread compiles it into an interpreter
+ * state of its own the first time it runs it, so calls never share a state
+ * and take no lock. The script returns the function to call per request.
+ *
+ * States are not freed when a thread exits, only with the VCL. Varnish keeps
+ * its worker threads for a long time, so this bounds them to the threads
+ * that ever ran the script, and spares a thread exit racing a VCL discard. */
+
+static struct script_stats stats;
+
+#ifdef HAVE_LUA
+
+#if LUA_VERSION_NUM >= 502
+#define lua_objlen(L, i)        lua_rawlen(L, i)
+#endif
+
+#define SCRIPT_LOAD_TIMEOUT     1.0     /* Seconds to run the script body */
+#define SCRIPT_ERROR_MAX        256     /* Longest error message kept */
+
+struct script_state {
+    unsigned magic;
+#define SCRIPT_STATE_MAGIC 0x7C2E19B4
+    lua_State                   *L;
+    int                         fn;         /* Registry ref of the handler */
+    VTAILQ_ENTRY(script_state)  list;
+};
+
+struct script {
+    unsigned magic;
+#define SCRIPT_MAGIC 0x51A3F0D8
+    char                        *name;      /* Chunk name, "@file" */
+    char                        *source;
+    size_t                      len;
+    pthread_key_t               key;        /* State of the calling thread */
+    pthread_mutex_t             mtx;        /* Only guards the list */
+    VTAILQ_HEAD(, script_state) states;
+};
+
+/* States are per thread, so is the deadline of the run in progress */
+static __thread double deadline;
+
+static void
+hook(lua_State *L, lua_Debug *ar)
+{
+    (void)ar;
+
+    if (VTIM_mono() > deadline)
+        (void)luaL_error(L, "timed out");
+}
+
+static char *
+error_copy(lua_State *L)
+{
+    const char *msg = lua_tostring(L, -1);
+    char *err = strdup(msg ? msg : "error object is not a string");
+
+    AN(err);
+    return err;
+}
+
+/* Compiles and runs the script in a new state. Returns NULL with the error
+ * in *errp, to be freed by the caller. */
+static lua_State *
+load(const struct script *s, int *fn, char **errp)
+{
+    lua_State *L = luaL_newstate();
+
+    if (L == NULL) {
+        *errp = strdup("out of memory");
+        AN(*errp);
+        return NULL;
+    }
+
+    luaL_openlibs(L);
+#ifdef LUA_JITLIBNAME
+    /* Count hooks do not fire inside compiled traces, so LuaJIT only runs as
+     * an interpreter here, and the jit module that could turn it back on is
+     * not available to the script */
+    (void)luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+    lua_pushnil(L);
+    lua_setglobal(L, LUA_JITLIBNAME);
+    lua_getglobal(L, LUA_LOADLIBNAME);
+    lua_getfield(L, -1, "loaded");
+    lua_pushnil(L);
+    lua_setfield(L, -2, LUA_JITLIBNAME);
+    lua_pop(L, 2);
+#endif
+    lua_sethook(L, hook, LUA_MASKCOUNT, SCRIPT_HOOK_COUNT);
+    deadline = VTIM_mono() + SCRIPT_LOAD_TIMEOUT;
+
+    if (luaL_loadbuffer(L, s->source, s->len, s->name) != 0 ||
+        lua_pcall(L, 0, 1, 0) != 0) {
+        *errp = error_copy(L);
+        lua_close(L);
+        return NULL;
+    }
+
+    if (!lua_isfunction(L, -1)) {
+        *errp = strdup("script must return a function");
+        AN(*errp);
+        lua_close(L);
+        return NULL;
+    }
+
+    *fn = luaL_ref(L, LUA_REGISTRYINDEX);
+    return L;
+}
+
+static int
+read_file(const char *file, char **datap, size_t *lenp)
+{
+    FILE *fp = fopen(file, "r");
+    long len;
+
+    if (fp == NULL)
+        return 0;
+
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) != 0) {
+        (void)fclose(fp);
+        return 0;
+    }
+
+    char *data = malloc((size_t)len + 1);
+    AN(data);
+
+    if (fread(data, 1, (size_t)len, fp) != (size_t)len) {
+        free(data);
+        (void)fclose(fp);
+        return 0;
+    }
+    (void)fclose(fp);
+
+    data[len] = '\0';
+    *datap = data;
+    *lenp = (size_t)len;
+    return 1;
+}
+
+/* Reads the script and checks that it compiles and returns a function.
+ * Returns NULL with the error in *errp, to be freed by the caller. */
+struct script *
+script_new(const char *file, char **errp)
+{
+    struct script *s;
+    lua_State *L;
+    int fn;
+
+    AN(file);
+    AN(errp);
+
+    ALLOC_OBJ(s, SCRIPT_MAGIC);
+    AN(s);
+
+    if (!read_file(file, &s->source, &s->len)) {
+        FREE_OBJ(s);
+        *errp = strdup("cannot read script");
+        AN(*errp);
+        return NULL;
+    }
+
+    s->name = malloc(strlen(file) + 2);
+    AN(s->name);
+    s->name[0] = '@';
+    strcpy(s->name + 1, file);
+
+    L = load(s, &fn, errp);
+    if (L == NULL) {
+        free(s->name);
+        free(s->source);
+        FREE_OBJ(s);
+        return NULL;
+    }
+    lua_close(L);
+
+    if (pthread_key_create(&s->key, NULL) != 0) {
+        free(s->name);
+        free(s->source);
+        FREE_OBJ(s);
+        *errp = strdup("too many scripts loaded");
+        AN(*errp);
+        return NULL;
+    }
+
+    AZ(pthread_mutex_init(&s->mtx, NULL));
+    VTAILQ_INIT(&s->states);
+
+    return s;
+}
+
+/* Only called once no request can be running the script */
+void
+script_free(struct script *s)
+{
+    struct script_state *st, *st2;
+
+    if (s == NULL)
+        return;
+
+    CHECK_OBJ_NOTNULL(s, SCRIPT_MAGIC);
+
+    VTAILQ_FOREACH_SAFE(st, &s->states, list, st2) {
+        CHECK_OBJ_NOTNULL(st, SCRIPT_STATE_MAGIC);
+        VTAILQ_REMOVE(&s->states, st, list);
+        lua_close(st->L);
+        FREE_OBJ(st);
+    }
+
+    AZ(pthread_key_delete(s->key));
+    AZ(pthread_mutex_destroy(&s->mtx));
+    free(s->name);
+    free(s->source);
+    FREE_OBJ(s);
+}
+
+static void
+fail(struct vsb *out, const char *msg)
+{
+    size_t len;
+
+    if (msg == NULL)
+        msg = "error object is not a string";
+
+    len = strlen(msg);
+    if (len > SCRIPT_ERROR_MAX)
+        len = SCRIPT_ERROR_MAX;
+
+    VSB_clear(out);
+    VSB_bcat(out, msg, len);
+    __sync_add_and_fetch(&stats.errors, 1);
+}
+
+/* Returns the state of the calling thread, creating it on first use */
+static struct script_state *
+get_state(struct script *s, struct vsb *out)
+{
+    struct script_state *st = pthread_getspecific(s->key);
+    char *err = NULL;
+
+    if (st != NULL) {
+        CHECK_OBJ(st, SCRIPT_STATE_MAGIC);
+        return st;
+    }
+
+    ALLOC_OBJ(st, SCRIPT_STATE_MAGIC);
+    AN(st);
+
+    st->L = load(s, &st->fn, &err);
+    if (st->L == NULL) {
+        fail(out, err);
+        free(err);
+        FREE_OBJ(st);
+        return NULL;
+    }
+
+    AZ(pthread_setspecific(s->key, st));
+
+    AZ(pthread_mutex_lock(&s->mtx));
+    VTAILQ_INSERT_TAIL(&s->states, st, list);
+    AZ(pthread_mutex_unlock(&s->mtx));
+
+    __sync_add_and_fetch(&stats.states, 1);
+    return st;
+}
+
+/* Pushes the request table: path, method, url and headers by lower case name.
+ * Repeated headers are joined with ", ". */
+static void
+push_request(lua_State *L, const char *path, const struct script_field *f,
+             unsigned n)
+{
+    lua_createtable(L, 0, 4);
+
+    lua_pushstring(L, path);
+    lua_setfield(L, -2, "path");
+    lua_pushlstring(L, f[0].b, (size_t)(f[0].e - f[0].b));
+    lua_setfield(L, -2, "method");
+    lua_pushlstring(L, f[1].b, (size_t)(f[1].e - f[1].b));
+    lua_setfield(L, -2, "url");
+
+    lua_createtable(L, 0, (int)n);
+
+    for (unsigned i = 2; i < n; i++) {
+        const char *c = memchr(f[i].b, ':', (size_t)(f[i].e - f[i].b));
+        luaL_Buffer name;
+
+        if (c == NULL)
+            continue;
+
+        luaL_buffinit(L, &name);
+        for (const char *p = f[i].b; p < c; p++)
+            luaL_addchar(&name, tolower((unsigned char)*p));
+        luaL_pushresult(&name);
+
+        const char *v = c + 1;
+        while (v < f[i].e && (*v == ' ' || *v == '\t'))
+            v++;
+
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        if (lua_isstring(L, -1)) {
+            lua_pushliteral(L, ", ");
+            lua_pushlstring(L, v, (size_t)(f[i].e - v));
+            lua_concat(L, 3);
+        }
+        else {
+            lua_pop(L, 1);
+            lua_pushlstring(L, v, (size_t)(f[i].e - v));
+        }
+        lua_rawset(L, -3);
+    }
+
+    lua_setfield(L, -2, "headers");
+}
+
+/* Writes one list of the returned table as compact records */
+static int
+collect(lua_State *L, const char *list, char type, struct vsb *out)
+{
+    lua_getfield(L, -1, list);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        VSB_clear(out);
+        VSB_printf(out, "%s is not a table", list);
+        return -1;
+    }
+
+    size_t n = lua_objlen(L, -1);
+
+    for (size_t i = 1; i <= n; i++) {
+        size_t len;
+
+        lua_rawgeti(L, -1, (int)i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            lua_pop(L, 2);
+            VSB_clear(out);
+            VSB_printf(out, "%s[%zu] is not a string", list, i);
+            return -1;
+        }
+
+        const char *hdr = lua_tolstring(L, -1, &len);
+        if (memchr(hdr, '\n', len) || memchr(hdr, '\r', len)) {
+            lua_pop(L, 2);
+            VSB_clear(out);
+            VSB_printf(out, "%s[%zu] has a line break", list, i);
+            return -1;
+        }
+
+        VSB_printf(out, "%c %zu ", type, len);
+        VSB_bcat(out, hdr, len);
+        VSB_putc(out, '\n');
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+    return 0;
+}
+
+/* Runs the script for one request. Fields are the method, the url, then one
+ * "Name: value" per header. The headers the script returned are written to
+ * out in the compact format, see RESPONSE FORMATS in README.rst. Returns 0,
+ * or -1 with the error message in out instead. */
+int
+script_call(struct script *s, const char *path, const struct script_field *f,
+            unsigned n, double timeout, struct vsb *out)
+{
+    struct script_state *st;
+    int r = 0;
+
+    CHECK_OBJ_NOTNULL(s, SCRIPT_MAGIC);
+    AN(path);
+    AN(f);
+    assert(n >= 2);
+    AN(out);
+
+    __sync_add_and_fetch(&stats.calls, 1);
+
+    st = get_state(s, out);
+    if (st == NULL)
+        return -1;
+
+    lua_State *L = st->L;
+    int top = lua_gettop(L);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->fn);
+    push_request(L, path, f, n);
+
+    deadline = VTIM_mono() + timeout;
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        fail(out, lua_tostring(L, -1));
+        lua_settop(L, top);
+        return -1;
+    }
+
+    if (lua_istable(L, -1)) {
+        if (collect(L, "vcl_recv", 'R', out) == -1 ||
+            collect(L, "vcl_deliver", 'D', out) == -1) {
+            __sync_add_and_fetch(&stats.errors, 1);
+            r = -1;
+        }
+    }
+    else if (!lua_isnil(L, -1)) {
+        fail(out, "script must return a table or nil");
+        r = -1;
+    }
+
+    lua_settop(L, top);
+    return r;
+}
+
+#else /* HAVE_LUA */
+
+/* Built without Lua, see --with-lua in configure. No script loads, so every
+ * call to its backend fails with "lua: not supported". */
+struct script *
+script_new(const char *file, char **errp)
+{
+    AN(file);
+    AN(errp);
+
+    *errp = strdup("not supported");
+    AN(*errp);
+    return NULL;
+}
+
+void
+script_free(struct script *s)
+{
+    AZ(s);
+}
+
+int
+script_call(struct script *s, const char *path, const struct script_field *f,
+            unsigned n, double timeout, struct vsb *out)
+{
+    WRONG("script_call() without Lua");
+    return -1;
+}
+
+#endif /* HAVE_LUA */
+
+void
+script_stats(struct script_stats *st)
+{
+    AN(st);
+
+    st->states = __sync_add_and_fetch(&stats.states, 0);
+    st->calls = __sync_add_and_fetch(&stats.calls, 0);
+    st->errors = __sync_add_and_fetch(&stats.errors, 0);
+}
@@ -0,0 +1,41 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SCRIPT_TIMEOUT          0.1     /* Seconds, unless a budget is set */
+#define SCRIPT_HOOK_COUNT       1000    /* Instructions between time checks */
+
+struct vsb;
+
+/* A Lua script compiled once per VCL and run by every worker thread in its
+ * own interpreter state */
+struct script;
+
+/* A request line or header as seen by the script */
+struct script_field {
+    const char                  *b;
+    const char                  *e;
+};
+
+struct script_stats {
+    uint64_t                    states;     /* Interpreter states created */
+    uint64_t                    calls;      /* Script runs */
+    uint64_t                    errors;     /* Runs that failed */
+};
+
+struct script *
+script_new(const char *file, char **errp);
+
+void
+script_free(struct script *s);
+
+int
+script_call(struct script *s, const char *path, const struct script_field *f,
+            unsigned n, double timeout, struct vsb *out);
+
+void
+script_stats(struct script_stats *stats);
+
+#endif
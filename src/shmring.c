@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vtim.h"
+
+#include "shmring.h"
+
+/* Worker side of the shared memory transport, see shmring.h for the layout.
+ * The file is mapped on first use rather than when the VCL loads, so the
+ * sidecar may start after Varnish. While it is missing, mapping is retried
+ * at most once per SHMRING_RETRY.
+ *
+ * The sidecar creates the file anew when it starts, so as often the file at
+ * the path is checked against the mapping. A mapping of another inode is
+ * retired, and unmapped once the last slot claimed in it is given back. */
+struct shmring_map {
+    struct shmring_hdr          *hdr;
+    dev_t                       dev;
+    ino_t                       ino;
+    unsigned                    refs;       /* Claimed slots, +1 if current */
+    struct shmring_map          *next;      /* Retired ones */
+};
+
+struct shmring {
+    unsigned magic;
+#define SHMRING_HANDLE_MAGIC 0x5D1CA2E7
+    char                        *path;
+    pthread_mutex_t             mtx;        /* Mappings and ring pushes */
+    struct shmring_map          *map;       /* NULL until mapped */
+    struct shmring_map          *retired;
+    double                      retry;
+    unsigned                    hint;       /* Where to look for a free slot */
+};
+
+struct shmring *
+shmring_new(const char *path)
+{
+    struct shmring *sc;
+
+    AN(path);
+
+    ALLOC_OBJ(sc, SHMRING_HANDLE_MAGIC);
+    AN(sc);
+    sc->path = strdup(path);
+    AN(sc->path);
+    AZ(pthread_mutex_init(&sc->mtx, NULL));
+
+    return sc;
+}
+
+static void
+unmap(struct shmring_map *m)
+{
+    AZ(munmap(m->hdr, sizeof *m->hdr));
+    free(m);
+}
+
+/* No call may be in flight */
+void
+shmring_free(struct shmring *sc)
+{
+    struct shmring_map *m;
+
+    if (sc == NULL)
+        return;
+
+    CHECK_OBJ_NOTNULL(sc, SHMRING_HANDLE_MAGIC);
+
+    if (sc->map)
+        unmap(sc->map);
+    while ((m = sc->retired) != NULL) {
+        sc->retired = m->next;
+        unmap(m);
+    }
+    AZ(pthread_mutex_destroy(&sc->mtx));
+    free(sc->path);
+    FREE_OBJ(sc);
+}
+
+static struct shmring_map *
+map(const char *path)
+{
+    struct shmring_map *m;
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof *m->hdr) {
+        AZ(close(fd));
+        return NULL;
+    }
+
+    p = mmap(NULL, sizeof *m->hdr, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    AZ(close(fd));
+    if (p == MAP_FAILED)
+        return NULL;
+
+    struct shmring_hdr *hdr = p;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC ||
+        hdr->version != SHMRING_VERSION || hdr->nslots != SHMRING_SLOTS) {
+        AZ(munmap(p, sizeof *m->hdr));
+        return NULL;
+    }
+
+    m = calloc(1, sizeof *m);
+    AN(m);
+    m->hdr = hdr;
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->refs = 1;
+
+    return m;
+}
+
+/* Caller must hold sc->mtx */
+static void
+unref(struct shmring *sc, struct shmring_map *m)
+{
+    struct shmring_map **mp;
+
+    assert(m->refs > 0);
+    if (--m->refs > 0)
+        return;
+
+    assert(m != sc->map);
+    for (mp = &sc->retired; *mp != m; mp = &(*mp)->next)
+        AN(*mp);
+    *mp = m->next;
+    unmap(m);
+}
+
+/* Caller must hold sc->mtx */
+static struct shmring_map *
+find(const struct shmring *sc, const struct shmring_slot *slot)
+{
+    struct shmring_map *m = sc->map;
+
+    if (m == NULL || slot < m->hdr->slots ||
+        slot >= m->hdr->slots + SHMRING_SLOTS) {
+        for (m = sc->retired; m != NULL; m = m->next) {
+            if (slot >= m->hdr->slots && slot < m->hdr->slots + SHMRING_SLOTS)
+                break;
+        }
+    }
+
+    AN(m);
+    return m;
+}
+
+/* Gives up a claimed slot of whichever mapping it is in */
+static void
+release(struct shmring *sc, const struct shmring_slot *slot)
+{
+    AZ(pthread_mutex_lock(&sc->mtx));
+    unref(sc, find(sc, slot));
+    AZ(pthread_mutex_unlock(&sc->mtx));
+}
+
+/* Caller must hold sc->mtx. Maps the file when it is not, and again when it
+ * is not the one mapped any more. */
+static void
+refresh(struct shmring *sc)
+{
+    struct shmring_map *m = sc->map;
+    struct stat st;
+    double now = VTIM_mono();
+
+    if (now < sc->retry)
+        return;
+    sc->retry = now + SHMRING_RETRY;
+
+    if (m != NULL && stat(sc->path, &st) == 0 && st.st_dev == m->dev &&
+        st.st_ino == m->ino)
+        return;
+
+    if (m != NULL) {
+        sc->map = NULL;
+        m->next = sc->retired;
+        sc->retired = m;
+        unref(sc, m);
+    }
+
+    sc->map = map(sc->path);
+}
+
+/* Claims a free slot, NULL when the sidecar is not there or all slots are
+ * in use */
+struct shmring_slot *
+shmring_get(struct shmring *sc)
+{
+    struct shmring_map *m;
+
+    CHECK_OBJ_NOTNULL(sc, SHMRING_HANDLE_MAGIC);
+
+    AZ(pthread_mutex_lock(&sc->mtx));
+    refresh(sc);
+    m = sc->map;
+    if (m != NULL)
+        m->refs++;
+    AZ(pthread_mutex_unlock(&sc->mtx));
+
+    if (m == NULL)
+        return NULL;
+
+    unsigned start = __sync_fetch_and_add(&sc->hint, 1);
+
+    for (unsigned i = 0; i < SHMRING_SLOTS; i++) {
+        struct shmring_slot *slot = &m->hdr->slots[(start + i) % SHMRING_SLOTS];
+
+        if (__sync_bool_compare_and_swap(&slot->state, SHMRING_FREE,
+            SHMRING_FILLING))
+            return slot;
+    }
+
+    AZ(pthread_mutex_lock(&sc->mtx));
+    unref(sc, m);
+    AZ(pthread_mutex_unlock(&sc->mtx));
+
+    return NULL;
+}
+
+/* Hands the request written into the slot to the sidecar. Slot states are
+ * written by another process too, so one that is not what this side left is
+ * reported rather than asserted on: this returns -1 and the slot must not be
+ * touched again. */
+int
+shmring_submit(struct shmring *sc, struct shmring_slot *slot, size_t len)
+{
+    CHECK_OBJ_NOTNULL(sc, SHMRING_HANDLE_MAGIC);
+    AN(slot);
+    assert(len <= SHMRING_REQ_MAX);
+
+    slot->req_len = (uint32_t)len;
+    slot->resp_len = 0;
+    slot->status = 0;
+    slot->type = SHMRING_TYPE_JSON;
+    if (!__sync_bool_compare_and_swap(&slot->state, SHMRING_FILLING,
+        SHMRING_SUBMITTED)) {
+        release(sc, slot);
+        return -1;
+    }
+
+    /* Only in flight slots are on the ring, so it cannot overflow. A retired
+     * mapping still takes it, the call then times out. */
+    AZ(pthread_mutex_lock(&sc->mtx));
+    struct shmring_hdr *hdr = find(sc, slot)->hdr;
+    uint32_t head = hdr->sq_head;
+    hdr->sq[head % SHMRING_SLOTS] = (uint32_t)(slot - hdr->slots);
+    __atomic_store_n(&hdr->sq_head, head + 1, __ATOMIC_RELEASE);
+    AZ(pthread_mutex_unlock(&sc->mtx));
+
+    shmring_futex_wake(&hdr->sq_head, 1);
+    return 0;
+}
+
+/* Waits up to timeout for the response, returns 1 when it is in the slot.
+ * On 0 the slot belongs to the sidecar, and on -1 the sidecar left it in
+ * another state than done. Either way it must not be touched again. */
+int
+shmring_wait(struct shmring *sc, struct shmring_slot *slot, double timeout)
+{
+    struct timespec rel;
+    double deadline = VTIM_mono() + timeout;
+    uint32_t state;
+
+    CHECK_OBJ_NOTNULL(sc, SHMRING_HANDLE_MAGIC);
+    AN(slot);
+
+    while ((state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) ==
+        SHMRING_SUBMITTED) {
+        double left = deadline - VTIM_mono();
+
+        if (left <= 0) {
+            if (__sync_bool_compare_and_swap(&slot->state, SHMRING_SUBMITTED,
+                SHMRING_ABANDONED)) {
+                release(sc, slot);
+                return 0;
+            }
+            continue;   /* Done just now */
+        }
+
+        rel.tv_sec = (time_t)left;
+        rel.tv_nsec = (long)((left - (time_t)left) * 1e9);
+        if (shmring_futex_wait(&slot->state, SHMRING_SUBMITTED, &rel) != 0)
+            assert(errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT);
+    }
+
+    if (state != SHMRING_DONE) {
+        release(sc, slot);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Frees a slot that is done with or was never submitted. Returns -1 and
+ * leaves it alone when the sidecar changed its state meanwhile. */
+int
+shmring_put(struct shmring *sc, struct shmring_slot *slot)
+{
+    CHECK_OBJ_NOTNULL(sc, SHMRING_HANDLE_MAGIC);
+    AN(slot);
+
+    uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    int r = 0;
+
+    if ((state != SHMRING_DONE && state != SHMRING_FILLING) ||
+        !__sync_bool_compare_and_swap(&slot->state, state, SHMRING_FREE))
+        r = -1;
+
+    release(sc, slot);
+    return r;
+}
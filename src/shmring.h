@@ -0,0 +1,103 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* Shared memory transport to a co-located sidecar. The sidecar creates the
+ * file (normally under /dev/shm) and both sides map it. It holds a fixed
+ * number of slots, each with room for one request and its response, and a
+ * submission ring of slot numbers.
+ *
+ * A worker claims a free slot, writes the request and pushes the slot number
+ * onto the ring, waking the sidecar through a futex on sq_head. The sidecar
+ * writes the response into the slot and wakes the worker through a futex on
+ * the slot state. A worker that gives up marks the slot abandoned, and the
+ * sidecar frees it once done with it.
+ *
+ * This file is shared with the reference sidecar, so it must not depend on
+ * anything from Varnish. */
+
+#define SHMRING_MAGIC           0x48505352  /* "HPSR" */
+#define SHMRING_VERSION         1
+#define SHMRING_SLOTS           64
+#define SHMRING_REQ_MAX         16384
+#define SHMRING_RESP_MAX        0x20000     /* Over PROXY_BODY_MAX */
+#define SHMRING_RETRY           1.0         /* Seconds between map attempts */
+
+/* Slot states */
+#define SHMRING_FREE            0
+#define SHMRING_FILLING         1   /* Claimed by a worker */
+#define SHMRING_SUBMITTED       2   /* On the ring or with the sidecar */
+#define SHMRING_DONE            3   /* Response ready */
+#define SHMRING_ABANDONED       4   /* Worker gave up, sidecar frees it */
+
+/* Response body formats, see RESPONSE FORMATS in README.rst */
+#define SHMRING_TYPE_JSON       0
+#define SHMRING_TYPE_COMPACT    1
+
+/* A request is newline separated lines: the script path, the method, the
+ * url, then one "Name: value" line per forwarded header. */
+struct shmring_slot {
+    uint32_t                    state;      /* Futex word */
+    uint32_t                    req_len;
+    uint32_t                    resp_len;
+    uint32_t                    status;     /* Like http, 200 is success */
+    uint32_t                    type;
+    uint32_t                    pad;
+    char                        req[SHMRING_REQ_MAX];
+    char                        resp[SHMRING_RESP_MAX];
+};
+
+struct shmring_hdr {
+    uint32_t                    magic;      /* Set last by the sidecar */
+    uint32_t                    version;
+    uint32_t                    nslots;
+    uint32_t                    pad;
+    uint32_t                    sq_head     /* Futex word, pushed by workers */
+                                __attribute__((aligned(64)));
+    uint32_t                    sq_tail     /* Popped by the sidecar */
+                                __attribute__((aligned(64)));
+    uint32_t                    sq[SHMRING_SLOTS];
+    struct shmring_slot         slots[SHMRING_SLOTS];
+};
+
+/* Both processes map the file, so these are not FUTEX_PRIVATE */
+static inline int
+shmring_futex_wait(uint32_t *addr, uint32_t val, const struct timespec *rel)
+{
+    return (int)syscall(SYS_futex, addr, FUTEX_WAIT, val, rel, NULL, 0);
+}
+
+static inline void
+shmring_futex_wake(uint32_t *addr, int n)
+{
+    (void)syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+/* Worker side, in shmring.c. The reference sidecar does not link it. */
+struct shmring;
+
+struct shmring *
+shmring_new(const char *path);
+
+void
+shmring_free(struct shmring *sc);
+
+struct shmring_slot *
+shmring_get(struct shmring *sc);
+
+int
+shmring_submit(struct shmring *sc, struct shmring_slot *slot, size_t len);
+
+int
+shmring_wait(struct shmring *sc, struct shmring_slot *slot, double timeout);
+
+int
+shmring_put(struct shmring *sc, struct shmring_slot *slot);
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vqueue.h"
+#include "vsb.h"
+
+#include "stats.h"
+
+/* Hot path counters and latency histograms. Every worker thread updates its
+ * own shard with plain increments, so there is no locking or cache line
+ * bouncing per call. Readers sum all shards under the list lock. Shards of
+ * exiting threads are folded into the retired totals. */
+
+struct stats_shard {
+    unsigned magic;
+#define STATS_SHARD_MAGIC 0x6A0C52F1
+    uint64_t                    c[STAT__MAX];
+    uint64_t                    lat[LAT__MAX][STATS_BUCKETS];
+    VTAILQ_ENTRY(stats_shard)   list;
+};
+
+/* Upper bounds in ms, the last bucket catches everything slower */
+static const unsigned bucket_ms[STATS_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000
+};
+
+static const char * const counter_names[STAT__MAX] = {
+#define STATS_NAME(n, d) #n,
+    STATS_COUNTERS(STATS_NAME)
+#undef STATS_NAME
+};
+
+static const char * const latency_names[LAT__MAX] = {
+    "connect", "ttfb", "total"
+};
+
+static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static VTAILQ_HEAD(, stats_shard) stats_shards =
+    VTAILQ_HEAD_INITIALIZER(stats_shards);
+static struct stats_shard stats_retired;
+static pthread_key_t stats_key;
+static __thread struct stats_shard *stats_shard = NULL;
+
+/* Bumped by stats_fini(), a thread whose shard was retired then finds its
+ * pointer stale and takes a new one */
+static unsigned stats_gen = 0;
+static __thread unsigned shard_gen = 0;
+
+static void
+fold(struct stats_shard *dst, const struct stats_shard *src)
+{
+    for (unsigned i = 0; i < STAT__MAX; i++)
+        dst->c[i] += src->c[i];
+
+    for (unsigned l = 0; l < LAT__MAX; l++)
+        for (unsigned b = 0; b < STATS_BUCKETS; b++)
+            dst->lat[l][b] += src->lat[l][b];
+}
+
+static void
+shard_retire(void *ptr)
+{
+    struct stats_shard *sh;
+    CAST_OBJ_NOTNULL(sh, ptr, STATS_SHARD_MAGIC);
+
+    AZ(pthread_mutex_lock(&stats_mtx));
+    VTAILQ_REMOVE(&stats_shards, sh, list);
+    fold(&stats_retired, sh);
+    AZ(pthread_mutex_unlock(&stats_mtx));
+
+    FREE_OBJ(sh);
+}
+
+static struct stats_shard *
+get_shard(void)
+{
+    struct stats_shard *sh = stats_shard;
+
+    if (sh != NULL && shard_gen == stats_gen)
+        return sh;
+
+    ALLOC_OBJ(sh, STATS_SHARD_MAGIC);
+    AN(sh);
+
+    AZ(pthread_mutex_lock(&stats_mtx));
+    VTAILQ_INSERT_TAIL(&stats_shards, sh, list);
+    AZ(pthread_mutex_unlock(&stats_mtx));
+
+    AZ(pthread_setspecific(stats_key, sh));
+    stats_shard = sh;
+    shard_gen = stats_gen;
+
+    return sh;
+}
+
+static void
+snapshot(struct stats_shard *sum)
+{
+    struct stats_shard *sh;
+
+    memset(sum, 0, sizeof *sum);
+
+    AZ(pthread_mutex_lock(&stats_mtx));
+    fold(sum, &stats_retired);
+    VTAILQ_FOREACH(sh, &stats_shards, list)
+        fold(sum, sh);
+    AZ(pthread_mutex_unlock(&stats_mtx));
+}
+
+static unsigned
+bucket(double secs)
+{
+    double ms = secs * 1e3;
+    unsigned b;
+
+    for (b = 0; b < STATS_BUCKETS - 1; b++) {
+        if (ms <= bucket_ms[b])
+            break;
+    }
+
+    return b;
+}
+
+void
+stats_init(void)
+{
+    AZ(pthread_key_create(&stats_key, shard_retire));
+}
+
+/* Retires the shards of every thread and deletes the key, so that no thread
+ * exiting after the vmod is unloaded runs shard_retire(). The other threads
+ * of the vmod must have been joined. */
+void
+stats_fini(void)
+{
+    struct stats_shard *sh;
+
+    AZ(pthread_mutex_lock(&stats_mtx));
+    while ((sh = VTAILQ_FIRST(&stats_shards)) != NULL) {
+        VTAILQ_REMOVE(&stats_shards, sh, list);
+        fold(&stats_retired, sh);
+        FREE_OBJ(sh);
+    }
+    stats_gen++;
+    AZ(pthread_mutex_unlock(&stats_mtx));
+
+    AZ(pthread_key_delete(stats_key));
+}
+
+void
+stats_add(enum stats_counter c, uint64_t n)
+{
+    assert(c < STAT__MAX);
+    get_shard()->c[c] += n;
+}
+
+void
+stats_latency(double connect, double ttfb, double total)
+{
+    struct stats_shard *sh = get_shard();
+
+    sh->lat[LAT_connect][bucket(connect)]++;
+    sh->lat[LAT_ttfb][bucket(ttfb)]++;
+    sh->lat[LAT_total][bucket(total)]++;
+}
+
+/* Histogram buckets are cumulative, "latency.total.le_5ms" counts every
+ * call that took 5ms or less */
+static uint64_t
+latency_le(const struct stats_shard *sum, unsigned l, unsigned b)
+{
+    uint64_t v = 0;
+
+    for (unsigned i = 0; i <= b; i++)
+        v += sum->lat[l][i];
+
+    return v;
+}
+
+static void
+bucket_name(char *buf, size_t len, unsigned l, unsigned b)
+{
+    if (b < STATS_BUCKETS - 1)
+        snprintf(buf, len, "latency.%s.le_%ums", latency_names[l], bucket_ms[b]);
+    else
+        snprintf(buf, len, "latency.%s.le_inf", latency_names[l]);
+}
+
+long
+stats_stat(const char *name)
+{
+    struct stats_shard sum;
+    char buf[64];
+
+    AN(name);
+    snapshot(&sum);
+
+    if (strncmp(name, "proxy.", 6) == 0) {
+        for (unsigned i = 0; i < STAT__MAX; i++) {
+            if (strcmp(name + 6, counter_names[i]) == 0)
+                return (long)sum.c[i];
+        }
+    }
+    else if (strncmp(name, "latency.", 8) == 0) {
+        for (unsigned l = 0; l < LAT__MAX; l++) {
+            for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+                bucket_name(buf, sizeof buf, l, b);
+                if (strcmp(name, buf) == 0)
+                    return (long)latency_le(&sum, l, b);
+            }
+        }
+    }
+
+    return 0;
+}
+
+void
+stats_dump(struct vsb *vsb)
+{
+    struct stats_shard sum;
+    char buf[64];
+
+    AN(vsb);
+    snapshot(&sum);
+
+    for (unsigned i = 0; i < STAT__MAX; i++)
+        VSB_printf(vsb, "proxy.%s %ju\n", counter_names[i], (uintmax_t)sum.c[i]);
+
+    for (unsigned l = 0; l < LAT__MAX; l++) {
+        for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+            bucket_name(buf, sizeof buf, l, b);
+            VSB_printf(vsb, "%s %ju\n", buf, (uintmax_t)latency_le(&sum, l, b));
+        }
+    }
+}
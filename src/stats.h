@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+struct vsb;
+
+#define STATS_COUNTERS(X) \
+    X(calls,            "Web script calls completed") \
+    X(success,          "Calls decoded without error") \
+    X(curl_timeout,     "Calls failed with a curl timeout") \
+    X(curl_connect,     "Calls failed to connect") \
+    X(curl_other,       "Calls failed with another curl error") \
+    X(non200,           "Responses with a status other than 200") \
+    X(parse_fail,       "Responses that failed to parse") \
+    X(bytes,            "Response body bytes received") \
+    X(recv_headers,     "Headers applied in vcl_recv") \
+    X(deliver_headers,  "Headers applied in vcl_deliver") \
+    X(hedges,           "Hedge calls sent") \
+    X(hedge_wins,       "Hedge calls that answered first") \
+    X(hedge_skipped,    "Hedges not sent for lack of another backend") \
+    X(sidecar_calls,    "Calls answered by a sidecar") \
+    X(sidecar_timeout,  "Sidecar calls given up on")
+
+enum stats_counter {
+#define STATS_ENUM(n, d) STAT_##n,
+    STATS_COUNTERS(STATS_ENUM)
+#undef STATS_ENUM
+    STAT__MAX
+};
+
+enum stats_latency {
+    LAT_connect = 0,
+    LAT_ttfb,
+    LAT_total,
+    LAT__MAX
+};
+
+#define STATS_BUCKETS           11      /* See bucket_ms[] in stats.c */
+
+#define STATS_INC(n)            stats_add(STAT_##n, 1)
+#define STATS_ADD(n, v)         stats_add(STAT_##n, (uint64_t)(v))
+
+void
+stats_init(void);
+
+void
+stats_fini(void);
+
+void
+stats_add(enum stats_counter c, uint64_t n);
+
+void
+stats_latency(double connect, double ttfb, double total);
+
+long
+stats_stat(const char *name);
+
+void
+stats_dump(struct vsb *vsb);
+
+#endif
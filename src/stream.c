@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "miniobj.h"
+#include "vsb.h"
+
+#include "jscan.h"
+#include "stream.h"
+
+/* A json body is handed to jscan as it arrives, resuming where the last chunk
+ * left off. jscan, like jsmn (not strict), takes a primitive cut short by the
+ * end of the data as complete, so each pass stops after the last byte that
+ * cannot be inside one. A string cut short is fine, jscan returns
+ * JSMN_ERROR_PART and starts over from its opening quote on the next pass. */
+static int
+is_boundary(char c)
+{
+    switch (c) {
+    case ' ': case '\t': case '\r': case '\n':
+    case ',': case ':': case '"':
+    case '{': case '}': case '[': case ']':
+        return 1;
+    }
+    return 0;
+}
+
+static int
+fail(struct stream *st, enum stream_error error)
+{
+    st->state = STREAM_FAILED;
+    st->error = error;
+    return -1;
+}
+
+/* Tokens of the sync calls of a worker thread, kept for its next call. The
+ * heap is only touched when a response needs more than the thread had so
+ * far. A worker has one call at a time, its stream is done with before
+ * curl_sync() returns. */
+static __thread jsmntok_t *thread_toks = NULL;
+static __thread unsigned thread_ntoks = 0;
+
+static int
+grow(struct stream *st)
+{
+    unsigned n;
+
+    if (st->ntoks >= st->max_tokens)
+        return 0;
+
+    n = st->ntoks ? st->ntoks * 2 : STREAM_TOKENS;
+    if (n > st->max_tokens)
+        n = st->max_tokens;
+
+    if (!st->local) {
+        st->toks = realloc(st->toks, n * sizeof *st->toks);
+        AN(st->toks);
+        st->ntoks = n;
+        return 1;
+    }
+
+    if (thread_ntoks < n) {
+        thread_toks = realloc(thread_toks, n * sizeof *thread_toks);
+        AN(thread_toks);
+        thread_ntoks = n;
+    }
+
+    st->toks = thread_toks;
+    st->ntoks = thread_ntoks < st->max_tokens ? thread_ntoks : st->max_tokens;
+    return 1;
+}
+
+/* Runs jscan over the first len bytes of the body, from where it stopped last.
+ * Tokens are only grown on demand, jscan resumes after JSMN_ERROR_NOMEM. */
+static int
+parse(struct stream *st, size_t len)
+{
+    /* The vsb is not finished yet, VSB_data() would assert */
+    const char *js = st->body->s_buf;
+    int r;
+
+    while ((r = jscan_parse(&st->parser, js, len, st->toks, st->ntoks)) ==
+        JSMN_ERROR_NOMEM) {
+        if (!grow(st))
+            break;
+    }
+
+    return r;
+}
+
+/* local streams take their tokens from the buffer of the calling thread, and
+ * must be done with on it */
+void
+stream_init(struct stream *st, struct vsb *body, CURL *ch, size_t max_body,
+            unsigned max_tokens, unsigned local)
+{
+    AN(st);
+    CHECK_OBJ_NOTNULL(body, VSB_MAGIC);
+    AN(max_tokens);
+
+    stream_fini(st);
+    st->magic = STREAM_MAGIC;
+    st->body = body;
+    st->ch = ch;
+    st->max_body = max_body;
+    st->max_tokens = max_tokens;
+    st->local = local;
+}
+
+/* Also fine on a zeroed stream */
+void
+stream_fini(struct stream *st)
+{
+    AN(st);
+
+    if (!st->local)
+        free(st->toks);
+    memset(st, 0, sizeof *st);
+}
+
+/* Hands the stream of a finished job over to the request */
+void
+stream_move(struct stream *dst, struct stream *src)
+{
+    stream_fini(dst);
+    *dst = *src;
+    memset(src, 0, sizeof *src);
+}
+
+/* Called with the first chunk, once the Content-Type is known */
+void
+stream_begin(struct stream *st, unsigned json)
+{
+    CHECK_OBJ_NOTNULL(st, STREAM_MAGIC);
+    assert(st->state == STREAM_NEW);
+
+    if (!json) {
+        st->state = STREAM_RAW;
+        return;
+    }
+
+    st->state = STREAM_JSON;
+    jsmn_init(&st->parser);
+    AN(grow(st));
+}
+
+/* Appends a chunk and parses as far as it can. Returns -1 when the transfer
+ * should be aborted, with st->error set. */
+int
+stream_feed(struct stream *st, const char *data, size_t len)
+{
+    CHECK_OBJ_NOTNULL(st, STREAM_MAGIC);
+    assert(st->state != STREAM_NEW);
+
+    if (st->state == STREAM_FAILED)
+        return -1;
+
+    size_t have = (size_t)VSB_len(st->body);
+
+    if (have + len > st->max_body)
+        return fail(st, STREAM_TOO_BIG);
+
+    VSB_bcat(st->body, data, len);
+
+    if (st->state == STREAM_RAW || len == 0)
+        return 0;
+
+    /* Anything but an object or an array is refused at its first byte */
+    if (st->parser.toknext == 0) {
+        size_t i = 0;
+
+        while (i < len && isspace((unsigned char)data[i]))
+            i++;
+        if (i < len && data[i] != '{' && data[i] != '[')
+            return fail(st, STREAM_DELIMITERS);
+    }
+
+    size_t cut = len;
+    while (cut > 0 && !is_boundary(data[cut - 1]))
+        cut--;
+    if (cut == 0)
+        return 0;   /* Wait for the end of this primitive */
+
+    int r = parse(st, have + cut);
+
+    if (r == JSMN_ERROR_NOMEM)
+        return fail(st, STREAM_TOO_MANY_TOKENS);
+    else if (r == JSMN_ERROR_INVAL)
+        return fail(st, STREAM_INVALID);
+
+    return 0;
+}
+
+/* Parses what was held back at the end of the body. Returns 1 with the
+ * tokens, which stay owned by the stream, 0 when the body was not parsed as
+ * it arrived, or -1 with st->error set. */
+int
+stream_finish(struct stream *st, const jsmntok_t **toks, unsigned *n)
+{
+    AN(st);
+    AN(toks);
+    AN(n);
+
+    if (st->magic != STREAM_MAGIC || st->state != STREAM_JSON)
+        return 0;
+
+    int r = parse(st, (size_t)VSB_len(st->body));
+
+    if (r == JSMN_ERROR_NOMEM)
+        return fail(st, STREAM_TOO_MANY_TOKENS);
+    else if (r < 0)
+        return fail(st, STREAM_INVALID);
+
+    *toks = st->toks;
+    *n = st->parser.toknext;
+    return 1;
+}
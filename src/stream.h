@@ -0,0 +1,65 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <curl/curl.h>
+
+#include "jsmn.h"
+
+#define STREAM_TOKENS           64      /* First token array, grown x2 */
+
+enum stream_state {
+    STREAM_NEW = 0,                     /* Nothing received yet */
+    STREAM_JSON,                        /* Parsed as it arrives */
+    STREAM_RAW,                         /* Only collected, e.g. compact */
+    STREAM_FAILED                       /* Transfer aborted, see error */
+};
+
+enum stream_error {
+    STREAM_OK = 0,
+    STREAM_TOO_BIG,                     /* Over PROXY_BODY_MAX */
+    STREAM_DELIMITERS,                  /* Not a json object or array */
+    STREAM_INVALID,                     /* jscan refused it */
+    STREAM_TOO_MANY_TOKENS              /* Over max_tokens */
+};
+
+/* A response body being received. Json bodies are parsed chunk by chunk as
+ * curl hands them over, so a bad or oversized one aborts the transfer
+ * without waiting for the rest, and a good one is parsed by the time the
+ * transfer ends. The tokens are on the heap, or in the buffer of the worker
+ * thread for a local stream, until taken by parse_body(). */
+struct stream {
+    unsigned magic;
+#define STREAM_MAGIC 0x2A6F93D1
+    enum stream_state           state;
+    enum stream_error           error;
+    struct vsb                  *body;      /* Not owned */
+    CURL                        *ch;        /* For the Content-Type */
+    size_t                      max_body;
+    unsigned                    max_tokens;
+    jsmn_parser                 parser;
+    jsmntok_t                   *toks;
+    unsigned                    ntoks;      /* Allocated */
+    unsigned                    local;      /* toks is the thread's */
+};
+
+void
+stream_init(struct stream *st, struct vsb *body, CURL *ch, size_t max_body,
+            unsigned max_tokens, unsigned local);
+
+void
+stream_fini(struct stream *st);
+
+void
+stream_move(struct stream *dst, struct stream *src);
+
+void
+stream_begin(struct stream *st, unsigned json);
+
+int
+stream_feed(struct stream *st, const char *data, size_t len);
+
+int
+stream_finish(struct stream *st, const jsmntok_t **toks, unsigned *n);
+
+#endif
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""Stand-in web script speaking cleartext HTTP/2 with prior knowledge.
+
+Writes a VCL backend definition for the port it listens on to the file given
+as the first argument, then goes to the background. Every response tells
+which connection (counted from 1) and stream it came in on, and how many
+streams were answered together. A lone stream is held back for up to HOLD
+seconds to give a second one the chance to arrive on the same connection.
+The server exits after IDLE seconds without new connections.
+"""
+
+import os
+import select
+import socket
+import struct
+import sys
+import threading
+import time
+
+PREFACE = b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+HOLD = 2.0
+IDLE = 30.0
+
+DATA, HEADERS, SETTINGS, PING, GOAWAY = 0x0, 0x1, 0x4, 0x6, 0x7
+END_STREAM, ACK, END_HEADERS = 0x1, 0x1, 0x4
+
+
+def frame(ftype, flags, stream, payload=b""):
+    return (struct.pack(">I", len(payload))[1:] +
+            struct.pack(">BBI", ftype, flags, stream) + payload)
+
+
+def recv_exact(sock, n):
+    buf = b""
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise EOFError
+        buf += chunk
+    return buf
+
+
+def respond(sock, conn, streams):
+    for stream in streams:
+        body = ('{"vcl_recv": ["x-conn: %d", "x-stream: %d", "x-streams: %d"]}'
+                % (conn, stream, len(streams))).encode()
+        # 0x88 is the static table entry for ":status: 200"
+        sock.sendall(frame(HEADERS, END_HEADERS, stream, b"\x88") +
+                     frame(DATA, END_STREAM, stream, body))
+
+
+def serve(sock, conn):
+    pending = []
+    deadline = 0
+
+    try:
+        if recv_exact(sock, len(PREFACE)) != PREFACE:
+            return
+        sock.sendall(frame(SETTINGS, 0, 0))
+
+        while True:
+            if pending and (len(pending) >= 2 or time.time() >= deadline):
+                respond(sock, conn, pending)
+                pending = []
+
+            timeout = max(deadline - time.time(), 0.01) if pending else None
+            readable, _, _ = select.select([sock], [], [], timeout)
+            if not readable:
+                continue
+
+            hdr = recv_exact(sock, 9)
+            length = int.from_bytes(hdr[:3], "big")
+            ftype, flags = hdr[3], hdr[4]
+            stream = struct.unpack(">I", hdr[5:])[0] & 0x7FFFFFFF
+            payload = recv_exact(sock, length)
+
+            if ftype == SETTINGS and not flags & ACK:
+                sock.sendall(frame(SETTINGS, ACK, 0))
+            elif ftype == PING and not flags & ACK:
+                sock.sendall(frame(PING, ACK, 0, payload))
+            elif ftype == HEADERS and flags & END_STREAM:
+                if not pending:
+                    deadline = time.time() + HOLD
+                pending.append(stream)
+            elif ftype == GOAWAY:
+                return
+    except (EOFError, OSError):
+        pass
+    finally:
+        sock.close()
+
+
+def main():
+    lsock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    lsock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    lsock.bind(("127.0.0.1", 0))
+    lsock.listen(16)
+
+    with open(sys.argv[1], "w") as f:
+        f.write('backend h2c { .host = "127.0.0.1"; .port = "%d"; }\n'
+                % lsock.getsockname()[1])
+
+    if os.fork():
+        os._exit(0)
+
+    os.setsid()
+    devnull = os.open(os.devnull, os.O_RDWR)
+    for fd in (0, 1, 2):
+        os.dup2(devnull, fd)
+
+    conns = 0
+    lsock.settimeout(IDLE)
+    while True:
+        try:
+            sock, _ = lsock.accept()
+        except socket.timeout:
+            return
+        sock.settimeout(None)
+        conns += 1
+        threading.Thread(target=serve, args=(sock, conns), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,30 @@
+-- Rules for a25.vtc. Echoes the request back as headers, and fails on
+-- purpose for some paths.
+
+local calls = 0
+
+return function(req)
+    calls = calls + 1
+
+    if req.path == "/error" then
+        error("failed on purpose")
+    elseif req.path == "/bad" then
+        return { vcl_recv = { 42 } }
+    elseif req.path == "/loop" then
+        -- Compiled by LuaJIT unless its JIT is off, no hook would stop it
+        while true do end
+    end
+
+    return {
+        vcl_recv = {
+            "X-Lua-Path: " .. req.path,
+            "X-Lua-Method: " .. req.method,
+            "X-Lua-Url: " .. req.url,
+            "X-Lua-In: " .. (req.headers["x-in"] or "none"),
+            "X-Lua-Calls: " .. calls,
+        },
+        vcl_deliver = {
+            "Set-Cookie: lua=1",
+        },
+    }
+end
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Stand-in web script listening on the unix domain socket given as the first
+argument. Every response sets an x-unix header to the path that was called.
+The socket is bound before the server goes to the background, so it can be
+called as soon as the script returns. The server exits after IDLE seconds
+without requests.
+"""
+
+import http.server
+import json
+import os
+import socketserver
+import sys
+
+IDLE = 30.0
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        body = json.dumps({"vcl_recv": ["x-unix: " + self.path]}).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def address_string(self):
+        return "unix"
+
+    def log_message(self, format, *args):
+        pass
+
+
+class Server(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+    idle = False
+
+    def handle_timeout(self):
+        self.idle = True
+
+
+def main():
+    path = sys.argv[1]
+    if os.path.exists(path):
+        os.unlink(path)
+
+    server = Server(path, Handler)
+    server.timeout = IDLE
+
+    if os.fork():
+        os._exit(0)
+
+    os.setsid()
+    devnull = os.open(os.devnull, os.O_RDWR)
+    for fd in (0, 1, 2):
+        os.dup2(devnull, fd)
+
+    try:
+        while not server.idle:
+            server.handle_request()
+    finally:
+        os.unlink(path)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,29 +1,53 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "proxy.h"
 
 #include "vcc_if.h"
 
+/* VCLs importing the vmod. Events come from the CLI thread one at a time. */
+static unsigned loads = 0;
+
 int
 init_function(VRT_CTX, struct vmod_priv *priv, enum vcl_event_e e)
 {
-    if (e != VCL_EVENT_LOAD)
-      return 0;
-
-    proxy_init();
+    switch (e) {
+    case VCL_EVENT_LOAD:
+        if (loads++ == 0)
+            proxy_init();
+        priv->priv = proxy_config_new();
+        priv->free = proxy_config_free;
+        break;
+    case VCL_EVENT_DISCARD:
+        // The .so is unloaded after the last one, no thread may outlive it
+        assert(loads > 0);
+        if (--loads == 0)
+            proxy_fini();
+        break;
+    default:
+        break;
+    }
 
     return 0;
 }
 
+static struct proxy_config *
+get_config(struct vmod_priv *priv_vcl)
+{
+    struct proxy_config *cfg;
+    CAST_OBJ_NOTNULL(cfg, priv_vcl->priv, PROXY_CONFIG_MAGIC);
+    return cfg;
+}
+
 static struct proxy_request*
 get_request(VRT_CTX, struct vmod_priv *priv, int alloc)
 {
     struct proxy_request *req = (struct proxy_request *)priv->priv;
     CHECK_OBJ_ORNULL(req, PROXY_REQUEST_MAGIC);
 
-    if (alloc) {
-        AZ(req);
+    // A call again after std.rollback() reuses the request
+    if (alloc && req == NULL) {
         req = proxy_create_request(ctx);
         CHECK_OBJ_NOTNULL(req, PROXY_REQUEST_MAGIC);
         priv->priv = (void *)req;
@@ -33,8 +57,10 @@ get_request(VRT_CTX, struct vmod_priv *priv, int alloc)
     return req;
 }
 
-VCL_VOID
-vmod_call(VRT_CTX, struct vmod_priv *priv, VCL_BACKEND backend, VCL_STRING path)
+static void
+call(VRT_CTX, struct vmod_priv *priv_vcl, struct vmod_priv *priv,
+     VCL_BACKEND backend, VCL_STRING path, VCL_STRING key, VCL_DURATION ttl,
+     unsigned coalesce, VCL_DURATION budget)
 {
     if (ctx->method != VCL_MET_RECV)
         return;
@@ -44,7 +70,7 @@ vmod_call(VRT_CTX, struct vmod_priv *priv, VCL_BACKEND backend, VCL_STRING path)
     CHECK_OBJ_ORNULL(req, PROXY_REQUEST_MAGIC);
 
     // No req is valid if top-level VCL chose not create one
-    if (!req && !alloc)
+    if (!req)
         return;
 
     // Restarted requests need a clean slate for curl below
@@ -53,8 +79,221 @@ vmod_call(VRT_CTX, struct vmod_priv *priv, VCL_BACKEND backend, VCL_STRING path)
 
     // ESI requests reuse the same proxy headers
     // restarted requests regenerate the proxy headers
-    if (ctx->req->esi_level == 0)
+    if (ctx->req->esi_level == 0) {
+        req->config = get_config(priv_vcl);
+        req->budget = budget;
+        req->cache_key = NULL;
+        req->cache_ttl = 0;
+        req->flight_key = NULL;
+        req->flight_wait = 0;
+        if (key && *key && coalesce) {
+            // ttl is how long to wait for the leader, 0 disables coalescing
+            if (ttl > 0) {
+                req->flight_key = key;
+                req->flight_wait = ttl;
+            }
+        }
+        else if (key && *key) {
+            req->cache_key = key;
+            req->cache_ttl = ttl;
+        }
         proxy_curl(ctx, req, backend, path);
+    }
+
+    proxy_process_request(ctx, req);
+}
+
+VCL_VOID
+vmod_call(VRT_CTX, struct vmod_priv *priv_vcl, struct vmod_priv *priv,
+          VCL_BACKEND backend, VCL_STRING path, VCL_DURATION budget)
+{
+    call(ctx, priv_vcl, priv, backend, path, NULL, 0, 0, budget);
+}
+
+VCL_VOID
+vmod_call_cached(VRT_CTX, struct vmod_priv *priv_vcl, struct vmod_priv *priv,
+                 VCL_BACKEND backend, VCL_STRING path, VCL_STRING key,
+                 VCL_DURATION ttl, VCL_DURATION budget)
+{
+    call(ctx, priv_vcl, priv, backend, path, key, ttl, 0, budget);
+}
+
+VCL_VOID
+vmod_call_coalesced(VRT_CTX, struct vmod_priv *priv_vcl,
+                    struct vmod_priv *priv, VCL_BACKEND backend,
+                    VCL_STRING path, VCL_STRING key, VCL_DURATION timeout,
+                    VCL_DURATION budget)
+{
+    call(ctx, priv_vcl, priv, backend, path, key, timeout, 1, budget);
+}
+
+VCL_VOID
+vmod_forward(VRT_CTX, struct vmod_priv *priv_vcl, VCL_ENUM mode,
+             VCL_STRING headers)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    unsigned m = PROXY_FWD_ALL;
+
+    if (strcmp(mode, "allow") == 0)
+        m = PROXY_FWD_ALLOW;
+    else if (strcmp(mode, "deny") == 0)
+        m = PROXY_FWD_DENY;
+
+    proxy_config_forward(get_config(priv_vcl), m, headers);
+}
+
+VCL_VOID
+vmod_max_tokens(VRT_CTX, struct vmod_priv *priv_vcl, VCL_INT max)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    proxy_config_max_tokens(get_config(priv_vcl), max);
+}
+
+VCL_VOID
+vmod_breaker(VRT_CTX, struct vmod_priv *priv_vcl, VCL_REAL rate,
+             VCL_INT min_calls, VCL_DURATION max_latency, VCL_DURATION cooldown)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    proxy_config_breaker(get_config(priv_vcl), rate, min_calls, max_latency,
+        cooldown);
+}
+
+VCL_VOID
+vmod_hedge(VRT_CTX, struct vmod_priv *priv_vcl, VCL_DURATION delay)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    proxy_config_hedge(get_config(priv_vcl), delay);
+}
+
+VCL_VOID
+vmod_unix_socket(VRT_CTX, struct vmod_priv *priv_vcl, VCL_BACKEND backend,
+                 VCL_STRING path)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    if (backend == NULL)
+        return;
+
+    proxy_config_unix_socket(get_config(priv_vcl), backend, path);
+}
+
+VCL_VOID
+vmod_sidecar(VRT_CTX, struct vmod_priv *priv_vcl, VCL_BACKEND backend,
+             VCL_STRING path)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    if (backend == NULL)
+        return;
+
+    proxy_config_sidecar(get_config(priv_vcl), backend, path);
+}
+
+VCL_VOID
+vmod_lua(VRT_CTX, struct vmod_priv *priv_vcl, VCL_BACKEND backend,
+         VCL_STRING file)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    if (backend == NULL)
+        return;
+
+    proxy_config_lua(get_config(priv_vcl), backend, file);
+}
+
+VCL_VOID
+vmod_http2(VRT_CTX, struct vmod_priv *priv_vcl, VCL_BOOL enable)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    proxy_config_http2(get_config(priv_vcl), enable);
+}
+
+VCL_VOID
+vmod_cache_size(VRT_CTX, VCL_BYTES size)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    if (size >= 0)
+        proxy_set_cache_size((size_t)size);
+}
+
+VCL_VOID
+vmod_notify(VRT_CTX, struct vmod_priv *priv_vcl, VCL_BACKEND backend,
+            VCL_STRING path)
+{
+    if (ctx->method != VCL_MET_RECV && ctx->method != VCL_MET_DELIVER)
+        return;
+
+    proxy_notify(ctx, get_config(priv_vcl), backend, path);
+}
+
+VCL_VOID
+vmod_notify_config(VRT_CTX, VCL_INT batch, VCL_DURATION interval,
+                   VCL_DURATION max_wait)
+{
+    if (ctx->method != VCL_MET_INIT)
+        return;
+
+    proxy_notify_config(batch, interval, max_wait);
+}
+
+VCL_VOID
+vmod_start(VRT_CTX, struct vmod_priv *priv_vcl, struct vmod_priv *priv,
+           VCL_BACKEND backend, VCL_STRING path)
+{
+    if (ctx->method != VCL_MET_RECV)
+        return;
+
+    int alloc = (ctx->req->esi_level == 0 && ctx->req->restarts == 0);
+    struct proxy_request *req = get_request(ctx, priv, alloc);
+    CHECK_OBJ_ORNULL(req, PROXY_REQUEST_MAGIC);
+
+    if (!req)
+        return;
+
+    if (ctx->req->restarts != req->restarts)
+        proxy_restart_request(ctx, req);
+
+    // ESI requests reuse the proxy headers of the top-level request
+    if (ctx->req->esi_level == 0) {
+        req->config = get_config(priv_vcl);
+        req->budget = 0;
+        req->cache_key = NULL;
+        req->cache_ttl = 0;
+        req->flight_key = NULL;
+        req->flight_wait = 0;
+        proxy_start(ctx, req, backend, path);
+    }
+}
+
+VCL_VOID
+vmod_wait(VRT_CTX, struct vmod_priv *priv, VCL_DURATION timeout)
+{
+    if (ctx->method != VCL_MET_RECV)
+        return;
+
+    struct proxy_request *req = get_request(ctx, priv, 0);
+    CHECK_OBJ_ORNULL(req, PROXY_REQUEST_MAGIC);
+
+    if (!req)
+        return;
+
+    if (ctx->req->esi_level == 0)
+        proxy_wait(ctx, req, timeout);
 
     proxy_process_request(ctx, req);
 }
@@ -68,8 +307,12 @@ vmod_process(VRT_CTX, struct vmod_priv *priv)
     struct proxy_request *req = get_request(ctx, priv, 0);
     CHECK_OBJ_ORNULL(req, PROXY_REQUEST_MAGIC);
 
-    if (req)
+    if (req) {
+        // Joins a headerproxy.start() that was never waited on
+        if (ctx->req->esi_level == 0)
+            proxy_wait(ctx, req, 0);
         proxy_process_request(ctx, req);
+    }
 }
 
 VCL_STRING
@@ -86,3 +329,37 @@ vmod_error(VRT_CTX, struct vmod_priv *priv)
 
     return NULL;
 }
+
+VCL_INT
+vmod_stat(VRT_CTX, VCL_STRING name)
+{
+    return proxy_stat(name);
+}
+
+VCL_STRING
+vmod_stats(VRT_CTX)
+{
+    struct vsb vsb[1];
+    unsigned avail;
+    char *p;
+
+    CHECK_OBJ_NOTNULL(ctx, VRT_CTX_MAGIC);
+
+    avail = WS_Reserve(ctx->ws, 0);
+    p = ctx->ws->f;
+    AN(VSB_new(vsb, p, avail, VSB_FIXEDLEN));
+
+    proxy_stats_dump(vsb);
+
+    if (VSB_finish(vsb) != 0) {
+        VSB_delete(vsb);
+        WS_Release(ctx->ws, 0);
+        VSLb(ctx->vsl, SLT_Error, PROXY_NAME ": stats: out of workspace");
+        return NULL;
+    }
+
+    WS_Release(ctx->ws, VSB_len(vsb) + 1);
+    VSB_delete(vsb);
+
+    return p;
+}